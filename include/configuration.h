@@ -78,3 +78,47 @@
 #else
 #	error Please ensure you compile the driver with the makefile provided
 #endif
+
+// Log levels. Each module prints messages at or above the importance of its
+// level, and compiles out the rest. The levels are 0 (none), 1 (error),
+// 2 (warning), 3 (info), 4 (debug) and 5 (trace). Debug and trace messages 
+// only ever exist in DEBUG builds. LOG_LEVEL is the default, which each module
+// may override, e.g. -DHCD_LOG_LEVEL=1 to keep only errors from the HCD.
+#ifndef LOG_LEVEL
+#	if defined DEBUG
+#		define LOG_LEVEL 4
+#	else
+#		define LOG_LEVEL 3
+#	endif
+#endif
+#ifndef HCD_LOG_LEVEL
+#	define HCD_LOG_LEVEL LOG_LEVEL
+#endif
+#ifndef USBD_LOG_LEVEL
+#	define USBD_LOG_LEVEL LOG_LEVEL
+#endif
+#ifndef HUB_LOG_LEVEL
+#	define HUB_LOG_LEVEL LOG_LEVEL
+#endif
+#ifndef HID_LOG_LEVEL
+#	define HID_LOG_LEVEL LOG_LEVEL
+#endif
+
+// Rate limit of warnings. Each warning prints at most LOG_RATE_BURST times
+// every LOG_RATE_INTERVAL microseconds, so that error storms (such as a 
+// device which NAKs every transfer) cannot saturate the console.
+#ifndef LOG_RATE_INTERVAL
+#	define LOG_RATE_INTERVAL 1000000
+#endif
+#ifndef LOG_RATE_BURST
+#	define LOG_RATE_BURST 4
+#endif
+
+// Boot protocol. With -DHID_BOOT_PROTOCOL=1, boot keyboards and mice are 
+// left in the boot protocol, and read with the fixed boot report layout 
+// instead of fetching and parsing their own report descriptor. This makes 
+// them quicker to attach and to decode, but loses any controls only in 
+// their own reports, such as a mouse wheel or media keys.
+#ifndef HID_BOOT_PROTOCOL
+#	define HID_BOOT_PROTOCOL 0
+#endif
@@ -0,0 +1,199 @@
+/******************************************************************************
+*	device/hid/gamepad.h
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/gamepad.h contains definitions relating to game pads and
+*	joysticks.
+******************************************************************************/
+
+#ifndef GAMEPAD_H_
+#define GAMEPAD_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <device/hid/report.h>
+#include <usbd/device.h>
+#include <types.h>
+
+/** The DeviceDriver field in UsbDriverDataHeader for game pad devices. */
+#define DeviceDriverGamePad 0x47504431
+/** The maximum number of game pads the driver supports at once. */
+#define GamePadMaxGamePads 4
+/** The number of axes in GamePadState, one for each of DesktopX to
+	DesktopDial in order. */
+#define GamePadMaxAxes 8
+/** The maximum number of hat switches a game pad can report. */
+#define GamePadMaxHats 2
+/** The maximum number of buttons a game pad can report. Buttons 1 to 32 are
+	kept. */
+#define GamePadMaxButtons 32
+/** The number of events each game pad buffers between calls to
+	GamePadReadEvents. Must be a power of 2. */
+#define GamePadEventQueueSize 64
+/** The direction of a hat switch which is not pressed. */
+#define GamePadHatCentred -1
+
+/**
+	\brief The axes of a game pad, in the order of their usages.
+*/
+enum GamePadAxis {
+	GamePadAxisX = 0,
+	GamePadAxisY = 1,
+	GamePadAxisZ = 2,
+	GamePadAxisRX = 3,
+	GamePadAxisRY = 4,
+	GamePadAxisRZ = 5,
+	GamePadAxisSlider = 6,
+	GamePadAxisDial = 7,
+};
+
+/**
+	\brief The state of every control of a game pad.
+
+	Axes are normalised from the logical range of the device to -32767 to
+	32767, or 0 if the game pad does not have the axis. Hats are the
+	direction pressed, 0 for up then clockwise in eighths of a turn, or
+	GamePadHatCentred. Button n is pressed if bit n - 1 of Buttons is set.
+	The change masks have bit n set if control n changed in any report since
+	the last call to GamePadGetState.
+*/
+struct GamePadState {
+	s16 Axes[GamePadMaxAxes];
+	s8 Hats[GamePadMaxHats];
+	u32 Buttons;
+	u8 AxesChanged;
+	u8 HatsChanged;
+	u32 ButtonsChanged;
+};
+
+/**
+	\brief The kinds of control of a game pad.
+*/
+enum GamePadControl {
+	GamePadControlAxis = 0,
+	GamePadControlHat = 1,
+	GamePadControlButton = 2,
+};
+
+/**
+	\brief A change in one control of a game pad.
+
+	Index is the axis, hat, or button less one, and Value is as in
+	GamePadState, with buttons 1 when pressed and 0 when released.
+*/
+struct GamePadEvent {
+	/** MicroTime when the report with this change was received. */
+	u64 Time;
+	enum GamePadControl Control : 8;
+	u8 Index;
+	s16 Value;
+};
+
+/**
+	\brief An axis of the input report.
+
+	The axis is normalised as ((value - Minimum) * Scale >> 16) - 32767,
+	with Scale worked out once when the game pad is attached. Scale is 
+	rounded up, so that the ends of the range reach -32767 and 32767.
+*/
+struct GamePadAxisField {
+	struct HidParserField *Field;
+	enum GamePadAxis Axis : 8;
+	s32 Minimum;
+	u32 Scale;
+};
+
+/**
+	\brief Game pad specific data.
+
+	The contents of the driver data field for game pad devices. Placed in
+	HidDevice, as this driver is built atop that.
+*/
+struct GamePadDevice {
+	/** Standard driver data header. */
+	struct UsbDriverDataHeader Header;
+	/** Internal - Index in game pad arrays. */
+	u32 Index;
+	/** The input report with the controls. */
+	struct HidParserReport *Report;
+	/** The controls found in Report, packed into the first entries. */
+	u8 AxisCount;
+	u8 HatCount;
+	u8 ButtonCount;
+	struct GamePadAxisField Axes[GamePadMaxAxes];
+	struct HidParserField *Hats[GamePadMaxHats];
+	struct HidParserField *Buttons[GamePadMaxButtons];
+	/** The bit in GamePadState.Buttons of each field in Buttons. */
+	u8 ButtonBits[GamePadMaxButtons];
+	/** Internal - The state after the last report. */
+	struct GamePadState State;
+	/** Internal - Events not yet read by GamePadReadEvents. */
+	struct GamePadEvent Events[GamePadEventQueueSize];
+	/** Count of events added to Events. Only written when reports are
+		received. */
+	volatile u32 EventHead;
+	/** Count of events read from Events. Only written by
+		GamePadReadEvents. */
+	volatile u32 EventTail;
+	/** Count of events lost because Events was full. */
+	volatile u32 EventOverflows;
+};
+
+/**
+	\brief Enumerates a device as a game pad.
+
+	Attaches to a game pad or joystick application collection already
+	checked by HidAttach, and finds the axes, hat switches and buttons in
+	its input report, to enable the game pad methods.
+*/
+Result GamePadAttach(struct UsbDevice *device, u32 interface);
+
+/**
+	\brief Returns the number of game pads connected to the system.
+*/
+u32 GamePadCount();
+
+/**
+	\brief Returns the device address of the nth connected game pad.
+
+	Game pads that are connected are stored in an array, and this method
+	retrieves the nth item from that array. Returns 0 on error.
+*/
+u32 GamePadGetAddress(u32 index);
+
+/**
+	\brief Checks a given game pad.
+
+	Reads back every report the game pad has sent, updating its state and
+	queueing an event for each control that changed.
+*/
+Result GamePadPoll(u32 gamePadAddress);
+
+/**
+	\brief Reads the state of a game pad.
+
+	Copies the state after the last report received into state, and clears
+	the change masks. Call GamePadPoll first to receive the latest reports.
+*/
+Result GamePadGetState(u32 gamePadAddress, struct GamePadState *state);
+
+/**
+	\brief Reads queued events from a game pad.
+
+	Copies up to count of the oldest events found by GamePadPoll into
+	events, in the order they happened, and removes them from the queue.
+	Returns the number copied.
+*/
+u32 GamePadReadEvents(u32 gamePadAddress, struct GamePadEvent *events, u32 count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -85,43 +85,236 @@ enum HidReportType {
 	Feature = 3,
 };
 
+/** The number of input reports buffered per hid device. Power of 2. */
+#define HidReportRingSize 16
+/** The idle duration of a report which is only sent when it changes. */
+#define HidIdleInfinite 0
+
+/**
+	\brief An input report received from a hid device.
+
+	A raw input report as it arrived on the interrupt IN endpoint, stamped 
+	with when it was received.
+*/
+struct HidReportRecord {
+	/** MicroTime when the report was received. */
+	u64 Time;
+	/** Host frame number when the report was received. */
+	u32 Frame;
+	/** Length of the report in bytes, including any report id. */
+	u32 Length;
+	/** The report as received. Only valid until the record is drained. */
+	u8 *Data;
+};
+
+struct HidParserReport;
+struct HidParserField;
+
 /** The DeviceDriver field in UsbDriverDataHeader for hid devices. */
 #define DeviceDriverHid 0x48494430
+/** The most drivers that may be bound to one hid interface at once. */
+#define HidMaxBindings 4
+/** The most drivers that may be registered with HidRegisterDriver. */
+#define HidMaxDrivers 16
+/** The most hid devices HidGetDevice lists. */
+#define HidMaxDevices 16
+/** Priority of drivers for any device with a usage, such as the mouse. */
+#define HidPriorityGeneric 0
+/** Priority of drivers for particular devices, tried before generic ones. */
+#define HidPriorityDevice 16
+/** The most subscriptions one hid interface may have at once. */
+#define HidMaxSubscriptions 8
+/** An extended usage, with the usage page in the high 16 bits, as used to 
+	identify application collections. */
+#define HidUsage(page, usage) (((u32)(page) << 16) | (u16)(usage))
+
+/**
+	\brief A driver bound to a hid interface.
+
+	Each application collection of a hid interface may have a driver built
+	atop the hid driver. The driver's data is kept in DriverData, which 
+	starts with a header identifying the driver, and the driver is told of 
+	reports and removal through the handlers.
+*/
+struct HidBinding {
+	/** Usage of the application collection the driver was bound for. */
+	u32 Application;
+	/** The driver's data, or NULL if this binding is free. */
+	struct UsbDriverDataHeader *DriverData;
+	void (*HidDetached)(struct UsbDevice* device);
+	void (*HidDeallocate)(struct UsbDevice* device);
+	void (*HidReportReceived)(struct UsbDevice* device, struct HidParserReport *report, struct HidReportRecord *record);
+};
+
+/**
+	\brief A callback for the input reports of a hid interface.
+
+	Made by HidSubscribeReport, which sets ReportCallback, or by 
+	HidSubscribeUsage, which sets Field and UsageCallback. Called as each 
+	input report Report is drained, after the bound drivers.
+*/
+struct HidSubscription {
+	/** The input report subscribed to, or NULL if this subscription is 
+		free. */
+	struct HidParserReport *Report;
+	/** The field with Usage, or NULL for a subscription to the report. */
+	struct HidParserField *Field;
+	/** The value of an element of Field that means Usage is active, if 
+		Field is an array. */
+	u32 Element;
+	/** The extended usage subscribed to, as made by HidUsage. */
+	u32 Usage;
+	void (*ReportCallback)(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record, void *context);
+	void (*UsageCallback)(struct UsbDevice *device, u32 usage, s32 value, u64 time, void *context);
+	/** Passed to the callback. */
+	void *Context;
+};
 
 /** 
 	\brief Hid specific data.
 
 	The contents of the driver data field for hid devices. Chains to 
-	allow a stacked driver. 
+	allow stacked drivers, one per application collection. 
 */
 struct HidDevice {
 	struct UsbDriverDataHeader Header;
 	struct HidDescriptor *Descriptor;
 	struct HidParserResult *ParserResult;
-	struct UsbDriverDataHeader *DriverData;
-
-	// HID event handlers
-	void (*HidDetached)(struct UsbDevice* device);
-	void (*HidDeallocate)(struct UsbDevice* device);
+	/** Usage of the application collection a driver is being attached 
+		for. Only valid during a driver's attach method. */
+	u32 Application;
+	/** Whether reports on this interface are prefixed by a report id. */
+	bool ReportIds;
+	/** The boot protocol the interface was left in, 1 for a keyboard or 2 
+		for a mouse, or 0 if it uses its own report descriptor. */
+	u8 BootProtocol;
+	/** Size in bytes of each report in InputBuffer. At least the largest 
+		input report, with its id, and the interrupt IN endpoint's maximum 
+		packet size. */
+	u32 InputSize;
+	/** Storage for the reports in Ring, followed by one spare report that 
+		receives reports while the ring is full. */
+	u8 *InputBuffer;
+	/** Input reports received but not yet drained. */
+	struct HidReportRecord Ring[HidReportRingSize];
+	/** Count of reports added to Ring. Only written by HidPoll. */
+	volatile u32 RingHead;
+	/** Count of reports drained from Ring. Only written when draining. */
+	volatile u32 RingTail;
+	/** Count of reports lost because Ring was full. */
+	volatile u32 RingOverflows;
+	/** Polling period of the interrupt IN endpoint in microseconds. */
+	u32 PollInterval;
+	/** Time before which the interrupt IN endpoint is not polled again. */
+	u64 NextPoll;
+	/** The drivers bound to this interface. */
+	struct HidBinding Bindings[HidMaxBindings];
+	/** Number of Subscriptions in use, so that reports need not check them
+		when there are none. */
+	u32 SubscriptionCount;
+	struct HidSubscription Subscriptions[HidMaxSubscriptions];
 };
 
-#define HidUsageAttachCount 10
+/**
+	\brief Registers a driver for hid application collections.
+
+	Adds a method to attach a driver to application collections with the 
+	given usage page and usage, on devices with the given vendor and product
+	id, or any device if they are 0. When an interface is attached, each 
+	of its application collections is offered to the matching drivers, 
+	highest priority first, until one attaches; drivers of equal priority 
+	are offered it in the order they were registered. A driver already bound
+	to the interface keeps any further collections it matches. Called by 
+	the drivers' load methods from ConfigurationLoad().
+*/
+Result HidRegisterDriver(u16 page, u16 usage, u16 vendorId, u16 productId, u8 priority, 
+	Result (*attach)(struct UsbDevice *device, u32 interfaceNumber));
+
+/**
+	\brief Binds a driver to a hid interface.
+
+	Called by a driver's attach method to claim a binding for driverData, 
+	whose header must already identify the driver, for the application 
+	collection being attached. Returns the binding so the driver can set its
+	handlers, or NULL if the interface already has HidMaxBindings drivers.
+*/
+struct HidBinding *HidBindDriver(struct UsbDevice *device, struct UsbDriverDataHeader *driverData);
 
 /**
-	\brief Methods to attach an interface of particular hid desktop usage.
+	\brief Unbinds a driver from a hid interface.
 
-	The application desktop usage of the interface is the index into this array
-	of methods. The array is populated by ConfigurationLoad().
+	Frees the binding of the driver identified by driver. Its data must be
+	freed by the driver.
 */
-extern Result (*HidUsageAttach[HidUsageAttachCount])(struct UsbDevice *device, u32 interfaceNumber);
+void HidUnbindDriver(struct UsbDevice *device, u32 driver);
+
+/**
+	\brief Finds the binding of a driver on a hid interface.
+
+	Returns the binding of the driver whose data header has the DeviceDriver
+	field driver, or NULL if it is not bound to device.
+*/
+struct HidBinding *HidGetBinding(struct UsbDevice *device, u32 driver);
+
+/**
+	\brief Retrieves a driver's data for a hid interface.
+
+	Returns the DriverData of HidGetBinding(device, driver), or NULL.
+*/
+struct UsbDriverDataHeader *HidGetDriverData(struct UsbDevice *device, u32 driver);
+
+/**
+	\brief Lists the attached hid devices.
+
+	Returns the hid device at index, which is less than HidMaxDevices, or 
+	NULL if there is none. Devices keep their index while attached.
+*/
+struct UsbDevice *HidGetDevice(u32 index);
+
+/**
+	\brief Calls back for each input report with an id from a device.
+
+	Adds a subscription to the input report reportId of device, so that 
+	callback is called with context each time the report is drained, once 
+	its field values are decoded. Returns ErrorArgument if the device has no
+	such input report, or ErrorMemory if it already has HidMaxSubscriptions.
+*/
+Result HidSubscribeReport(struct UsbDevice *device, u8 reportId, 
+	void (*callback)(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record, void *context), 
+	void *context);
+
+/**
+	\brief Calls back with the value of a usage from a device.
+
+	Adds a subscription to the extended usage of device, as made by 
+	HidUsage, so that callback is called with context and the usage's value,
+	as HidGetUsageValue gives it, each time the input report with it is 
+	drained. Unchanged values are passed too, so that relative controls, 
+	such as a volume knob, see every step. The field is found once, here. 
+	Returns ErrorArgument if no input report has the usage, or ErrorMemory 
+	if the device already has HidMaxSubscriptions.
+*/
+Result HidSubscribeUsage(struct UsbDevice *device, u32 usage, 
+	void (*callback)(struct UsbDevice *device, u32 usage, s32 value, u64 time, void *context), 
+	void *context);
+
+/**
+	\brief Removes subscriptions from a device.
+
+	Removes every subscription to device made with context. Subscriptions 
+	are removed with the device, so need not be removed when it detaches.
+*/
+void HidUnsubscribe(struct UsbDevice *device, void *context);
 
 /**
 	\brief Retrieves a hid report.
 
 	Performs a hid get report request as defined in  in the USB HID 1.11 manual
-	in 7.2.1. 
+	in 7.2.1. This is a control request, so should only be used for feature 
+	reports or to fetch the initial state of a device. Input reports are 
+	streamed from the interrupt IN endpoint by HidPoll.
 */
-Result HidGetReport(struct UsbDevice *device, u8 endPoint, enum HidReportType reportType, 
+Result HidGetReport(struct UsbDevice *device, enum HidReportType reportType, 
 	u8 reportId, u8 interface, u32 bufferLength, void* buffer);
 
 /**
@@ -133,6 +326,17 @@ Result HidGetReport(struct UsbDevice *device, u8 endPoint, enum HidReportType re
 Result HidSetReport(struct UsbDevice *device, enum HidReportType reportType, 
 	u8 reportId, u8 interface, u32 bufferLength, void* buffer);
 
+/**
+	\brief Sets how often a device repeats an unchanged report.
+
+	Performs a hid set idle request as defined in the USB HID 1.11 manual in 
+	7.2.4. The device resends an input report that has not changed every 
+	duration * 4 milliseconds, or only when it changes if duration is 
+	HidIdleInfinite. A reportId of 0 applies to every report. Devices may 
+	refuse the request, mice in particular.
+*/
+Result HidSetIdle(struct UsbDevice *device, u8 interface, u8 reportId, u8 duration);
+
 /**
 	\brief Updates the device with the values of a report.
 
@@ -141,14 +345,49 @@ Result HidSetReport(struct UsbDevice *device, enum HidReportType reportType,
 */
 Result HidWriteDevice(struct UsbDevice *device, u8 report);
 
+/**
+	\brief Receives the next input report from the device.
+
+	Reads the interrupt IN endpoint of the hid interface, at most once per 
+	polling interval of the endpoint, and appends the report received to the
+	device's ring of input reports, stamped with the time and frame number. 
+	Returns ErrorRetry if the device had nothing new to report. The transfer
+	waits for the device with MicroDelay, so this must not be called from an
+	interrupt handler. It takes no locks and allocates nothing, so one 
+	context may poll while another drains with HidDrainReports. If the ring
+	is full the report is dropped and RingOverflows incremented.
+*/
+Result HidPoll(struct UsbDevice *device);
+
+/**
+	\brief Processes buffered input reports.
+
+	Removes up to count reports from the device's ring, oldest first. Each 
+	is routed to the parsed input report with the same id, whose buffer and 
+	field values are updated, and then passed to the HidReportReceived 
+	handlers of the bound drivers, and then to the subscriptions to it. 
+	Returns the number of reports drained.
+*/
+u32 HidDrainReports(struct UsbDevice *device, u32 count);
+
 /**
 	\brief Updates a report with the values from the device.
 
-	Reads the current values of a report from the device into memory. Implemented
-	using HidGetReport not interrupts.
+	Reads the current values of a report from the device into memory. Input
+	reports are received with HidPoll and every buffered report is drained, 
+	and ErrorRetry is returned if no new copy of this report arrived; other 
+	reports are requested with HidGetReport.
 */
 Result HidReadDevice(struct UsbDevice *device, u8 report);
-Result HidReadDeviceRaw(struct UsbDevice *device, u8 endPoint, u8 report, u8* buffer);
+
+/**
+	\brief Receives the raw bytes of an input report from the device.
+
+	As HidReadDevice, but stops draining at the first copy of this report and
+	also copies it as received, including any report id, to buffer. Reports
+	longer than bufferLength are truncated.
+*/
+Result HidReadDeviceRaw(struct UsbDevice *device, u8 report, u8* buffer, u32 bufferLength);
 
 /**
 	\brief Enumerates a device as a HID device.
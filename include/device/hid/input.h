@@ -0,0 +1,112 @@
+/******************************************************************************
+*	device/hid/input.h
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/input.h contains definitions relating to the input event
+*	stream, which gathers the events of every human interface device into one
+*	queue.
+******************************************************************************/
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <types.h>
+
+/** The number of events buffered between calls to InputReadEvents. Must be
+	a power of 2. */
+#define InputEventQueueSize 256
+
+/**
+	\brief The kinds of input event.
+
+	Modelled on the event types of evdev. The events from one report are
+	followed by an InputEventSync event. If the queue overflows, an
+	InputEventDropped event marks where events were lost.
+*/
+enum InputEventType {
+	/** Ends the events of one report from a device. Code and Value are 0. */
+	InputEventSync = 0,
+	/** A key or button, with Value 1 when pressed and 0 when released. */
+	InputEventKey = 1,
+	/** Motion of a relative axis, such as a mouse, by Value. */
+	InputEventRelative = 2,
+	/** A new value of an absolute axis, such as a touch screen or stick. */
+	InputEventAbsolute = 3,
+	/** Marks events lost to a full queue, like SYN_DROPPED of evdev. It is 
+		published at the first report boundary with room, in place of an
+		InputEventSync or before the events of a report. Events between the 
+		last InputEventSync and it are incomplete, so state tracked from 
+		events should be read again from the driver. Code and Value are 0. */
+	InputEventDropped = 4,
+};
+
+/**
+	\brief An input event.
+
+	One change to one control of a device. Code is the extended usage of the
+	control, with the usage page in the high 16 bits, as made by HidUsage,
+	so no table is needed to translate it.
+*/
+struct InputEvent {
+	/** MicroTime when the report with this event was received. */
+	u64 Time;
+	/** Address of the device. */
+	u32 Device;
+	enum InputEventType Type : 8;
+	u32 Code;
+	s32 Value;
+};
+
+/**
+	\brief Adds an event to the input event stream.
+
+	Called by the hid drivers as they decode reports. Events which do not
+	fit in the queue are counted by InputOverflows and lost, along with the
+	rest of their report, and InputEventDropped is published once there is
+	room again.
+*/
+void InputPublish(u32 device, enum InputEventType type, u32 code, s32 value, u64 time);
+
+/**
+	\brief Ends the events of a report.
+
+	Adds an InputEventSync event, if any event was added since the last, or
+	an InputEventDropped event if events were lost.
+*/
+void InputSync(u32 device, u64 time);
+
+/**
+	\brief Checks every hid device for reports.
+
+	Polls each hid device, and decodes the reports received, which adds
+	their events to the input event stream.
+*/
+Result InputPoll();
+
+/**
+	\brief Reads events from the input event stream.
+
+	Copies up to count of the oldest events into events, in the order they
+	happened, and removes them from the queue. Returns the number copied.
+	Only one caller may read events at a time.
+*/
+u32 InputReadEvents(struct InputEvent *events, u32 count);
+
+/**
+	\brief Returns the number of events lost because the queue was full.
+*/
+u32 InputOverflows();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INPUT_H_
@@ -56,9 +56,30 @@ struct KeyboardLeds {
 
 /** The DeviceDriver field in UsbDriverDataHeader for keyboard devices. */
 #define DeviceDriverKeyboard 0x4B424430
-/** The maximum number of keys a keyboard can report at once. Should be 
-	multiple of 2. */
-#define KeyboardMaxKeys 6
+/** The number of 32 bit words in the set of keys held down, one bit for 
+	each of the 256 usages of the keyboard page. */
+#define KeyboardKeyWords 8
+/** The number of key transitions each keyboard buffers between calls to 
+	KeyboardReadEvents. Must be a power of 2. */
+#define KeyboardEventQueueSize 64
+
+/**
+	\brief A key being pressed or released.
+
+	One transition of one key, as found by comparing a keyboard report with 
+	the one before. Modifier keys are reported as their keyboard page usages,
+	KeyboardLeftControl to KeyboardRightGui.
+*/
+struct KeyboardEvent {
+	/** MicroTime when the report with this transition was received. */
+	u64 Time;
+	/** The keyboard page usage of the key. */
+	u16 Key;
+	/** True if the key was pressed, false if it was released. */
+	bool Down;
+	/** Modifier keys held down after this report. */
+	struct KeyboardModifiers Modifiers;
+};
 
 /** 
 	\brief Keyboard specific data.
@@ -71,10 +92,11 @@ struct KeyboardDevice {
 	struct UsbDriverDataHeader Header;
 	/** Internal - Index in keyboard arrays. */
 	u32 Index;
-	/** Number of keys currently held down. */
+	/** Number of keys currently held down, not counting modifiers. */
 	u32 KeyCount;
-	/** Keys currently held down. */
-	u16 Keys[KeyboardMaxKeys];
+	/** Keys currently held down, including modifiers. Bit n of word n / 32 is
+		set when the key with usage n is down. */
+	u32 Keys[KeyboardKeyWords];
 	/** Modifier keys currently held down. */
 	struct KeyboardModifiers Modifiers;
 	/** Which LEDs this keyboard supports. */
@@ -83,10 +105,24 @@ struct KeyboardDevice {
 	struct HidParserField *LedFields[8];
 	/** Which fields in the Input report are for what modifiers and keys. */
 	struct HidParserField *KeyFields[8 + 1];
+	/** The fields of the Input report between these indices include one bit
+		fields for individual keys, as sent by n-key rollover keyboards. */
+	u16 KeyBitsFirst;
+	u16 KeyBitsEnd;
 	/** The LED report. */
 	struct HidParserReport *LedReport;
 	/** The input report. */
 	struct HidParserReport *KeyReport;
+	/** Internal - Transitions not yet read by KeyboardReadEvents. */
+	struct KeyboardEvent Events[KeyboardEventQueueSize];
+	/** Count of events added to Events. Only written when reports are 
+		received. */
+	volatile u32 EventHead;
+	/** Count of events read from Events. Only written by 
+		KeyboardReadEvents. */
+	volatile u32 EventTail;
+	/** Count of events lost because Events was full. */
+	volatile u32 EventOverflows;
 };
 
 /**
@@ -122,11 +158,22 @@ struct KeyboardLeds KeyboardGetLedSupport(u32 keyboardAddress);
 /**
 	\brief Checks a given keyboard.
 
-	Reads back the report from a given keyboard and parses it into the internal
-	fields. These can be accessed with KeyboardGet... methods
+	Reads back every report from a given keyboard and parses them into the 
+	internal fields. These can be accessed with KeyboardGet... methods. Each 
+	key pressed or released is queued for KeyboardReadEvents.
 */
 Result KeyboardPoll(u32 keyboardAddress);
 
+/**
+	\brief Reads queued key transitions from a keyboard.
+
+	Copies up to count of the oldest key transitions found by KeyboardPoll 
+	into events, in the order they happened, and removes them from the queue.
+	Returns the number copied. The queue has a single reader, but may be read
+	while another context polls the keyboard.
+*/
+u32 KeyboardReadEvents(u32 keyboardAddress, struct KeyboardEvent *events, u32 count);
+
 /**
 	\brief Reads the modifier keys from a keyboard.
 
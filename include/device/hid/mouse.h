@@ -25,6 +25,22 @@ extern "C"
 	multiple of 2. */
 #define MouseMaxKeys 6
 
+/**
+	\brief Motion of a mouse over a period.
+
+	The movement accumulated from every report received since the last call 
+	to MouseReadDeltas, in the logical units of the mouse.
+*/
+struct MouseDeltas {
+	s32 X;
+	s32 Y;
+	s32 Wheel;
+	/** Horizontal wheel (AC Pan), if the mouse has one. */
+	s32 Pan;
+	/** The buttons held down in the last report. */
+	u8 Buttons;
+};
+
 enum MouseDeviceButton {
 	MouseDeviceButtonLeft,
 	MouseDeviceButtonRight,
@@ -49,9 +65,26 @@ struct MouseDevice {
 	s16 mouseX;
 	s16 mouseY;
 	s16 wheel;
+	s16 pan;
 
 	/** The input report. */
 	struct HidParserReport *MouseReport;
+	/** Fields of the input report for each axis, or NULL if absent. */
+	struct HidParserField *XField;
+	struct HidParserField *YField;
+	struct HidParserField *WheelField;
+	struct HidParserField *PanField;
+	/** The fields of the input report between these indices include the 
+		buttons. */
+	u16 ButtonFirst;
+	u16 ButtonEnd;
+	/** Internal - Motion not yet read by MouseReadDeltas. */
+	struct MouseDeltas Deltas;
+	/** Internal - The last raw value of each absolute axis. */
+	s32 LastX;
+	s32 LastY;
+	s32 LastWheel;
+	s32 LastPan;
 };
 
 /**
@@ -99,6 +132,21 @@ s16 MouseGetPositionY(u32 mouseAddress);
 */
 s16 MouseGetWheel(u32 mouseAddress);
 
+/**
+	\brief Returns the current horizontal wheel value of the mouse
+*/
+s16 MouseGetPan(u32 mouseAddress);
+
+/**
+	\brief Reads the motion of a mouse since the last read.
+
+	Copies the motion accumulated from every report received since the last 
+	call into deltas, and starts accumulating afresh. Absolute axes report 
+	their change in position. Call MousePoll first to receive the latest 
+	reports.
+*/
+Result MouseReadDeltas(u32 mouseAddress, struct MouseDeltas *deltas);
+
 /**
 	\brief Returns the current X and Y coordinates of the mouse
 
@@ -206,7 +206,52 @@ enum HidUsagePageLed {
 	_HidUsagePageLed = 0xffff,
 };
 
+/**
+	\brief Values of the hid consumer page usage in a report.
+
+	Values that usage numbers in the consumer page represent. Defined in 
+	section 15 table 17 of the HID 1.11 usage tables. Only those the drivers 
+	here use are included.
+*/
+enum HidUsagePageConsumer {
+	ConsumerControl = 1,
+	ConsumerAcPan = 0x238,
+	_HidUsagePageConsumer = 0xffff,
+};
+
+/**
+	\brief Values of the hid digitizer page usage in a report.
+
+	Values that usage numbers in the digitizer page represent. Defined in 
+	section 16 table 17 of the HID 1.11 usage tables, with the contact usages
+	of the multi-touch extensions. Only those a touch driver needs are 
+	included here.
+*/
 enum HidUsagePageDigitlizer {
+	DigitlizerDigitizer = 1,
+	DigitlizerPen = 2,
+	DigitlizerLightPen = 3,
+	DigitlizerTouchScreen = 4,
+	DigitlizerTouchPad = 5,
+	DigitlizerWhiteBoard = 6,
+	DigitlizerStylus = 0x20,
+	DigitlizerPuck = 0x21,
+	DigitlizerFinger = 0x22,
+	DigitlizerTipPressure = 0x30,
+	DigitlizerBarrelPressure = 0x31,
+	DigitlizerInRange = 0x32,
+	DigitlizerTouch = 0x33,
+	DigitlizerUntouch = 0x34,
+	DigitlizerTap = 0x35,
+	DigitlizerTipSwitch = 0x42,
+	DigitlizerEraser = 0x45,
+	DigitlizerConfidence = 0x47,
+	DigitlizerWidth = 0x48,
+	DigitlizerHeight = 0x49,
+	DigitlizerContactIdentifier = 0x51,
+	DigitlizerContactCount = 0x54,
+	DigitlizerContactCountMaximum = 0x55,
+	DigitlizerScanTime = 0x56,
 	_HidUsagePageDigitlizer = 0xffff,
 };
 	
@@ -221,11 +266,23 @@ struct HidFullUsage {
 		enum HidUsagePageDesktop Desktop : 16;
 		enum HidUsagePageKeyboard Keyboard : 16;
 		enum HidUsagePageLed Led : 16;
+		enum HidUsagePageConsumer Consumer : 16;
 		enum HidUsagePageDigitlizer Digitlizer : 16;
 	};
 	enum HidUsagePage Page : 16;
 } __attribute__ ((__packed__));
 
+/**
+	\brief A range of HID usages.
+
+	The usages from First to Last, on the page of First, as declared by a 
+	usage minimum and maximum. Last equals First for a single usage.
+*/
+struct HidUsageRange {
+	struct HidFullUsage First;
+	u16 Last;
+};
+
 /** 
 	\brief A HID field units declaration.
 
@@ -262,15 +319,20 @@ struct HidUnit {
 struct HidParserField {
 	/** Size in bits of this field. For arrays, this is per element. */
 	u8 Size;
+	/** Number of UsageRanges. */
+	u8 UsageRangeCount;
 	/** Offset of this field into the report in bits */
-	u8 Offset;
+	u16 Offset;
 	/** Array fields have a number of individual fields. */
-	u8 Count;
+	u16 Count;
 	/** Attributes of this field */
 	struct HidMainItem Attributes __attribute__((aligned(4)));
-	/** Usage of this field. For array elements, this is the first usage, and 
-		it is assumed sequential values have sequential usage. */
+	/** Usage of this field. For array elements, this is the first usage; 
+		the usage of each value is given by HidGetArrayUsage. */
 	struct HidFullUsage Usage;
+	/** For array fields, the usages declared for the field, in order, which 
+		the values from LogicalMinimum up select. */
+	struct HidUsageRange *UsageRanges;
 	/** Usage of the physical connection this device is in, if present. */
 	struct HidFullUsage PhysicalUsage;
 	/** The minimum value of this field. */
@@ -285,8 +347,9 @@ struct HidParserField {
 	struct HidUnit Unit;
 	/** The base 10 exponenet of this field's physical quantity. */
 	s32 UnitExponent;
-	/** Current value of this field. This is the logical value. The value is 
-		not sign extended. */
+	/** Current value of this field. This is the logical value, sign 
+		extended if LogicalMinimum is negative. Array fields point to Count 
+		values, one u32 (or s32) per element. */
 	union {
 		u8 U8;
 		s8 S8;
@@ -299,6 +362,41 @@ struct HidParserField {
 	} Value;
 };
 
+/**
+	\brief How a value is extracted from a report.
+
+	The kinds of load used by an extraction plan. Byte aligned 8 and 16 bit 
+	values are read directly; all others are read with one 32 or 64 bit 
+	little endian load, then shifted and masked.
+*/
+enum HidExtractionKind {
+	ExtractByte = 0,
+	ExtractHalf = 1,
+	ExtractWord = 2,
+	ExtractWide = 3,
+};
+
+/**
+	\brief One step of an extraction plan.
+
+	Decodes one value, that is a variable field or one element of an array 
+	field, from a report buffer into the field's value.
+*/
+struct HidExtraction {
+	/** Byte of the report buffer containing the first bit of the value. */
+	u16 Byte;
+	/** Kind of load used to read the value. */
+	enum HidExtractionKind Kind : 8;
+	/** Bits to shift the loaded value right by. */
+	u8 Shift;
+	/** Mask of the value after shifting. */
+	u32 Mask;
+	/** Sign bit of the value, or 0 if it is not sign extended. */
+	u32 Sign;
+	/** Where the value is stored. */
+	u32 *Value;
+};
+
 /**
 	\brief A parsed report, with values.
 
@@ -309,24 +407,51 @@ struct HidParserReport {
 	/** Which report this is in the parser result. */
 	u8 Index;
 	/** There can be multiple fields in each report */
-	u8 FieldCount;
+	u16 FieldCount;
 	/** Report can have an ID. If not we use 0. */
 	u8 Id;
 	/** The type of this report. */
 	enum HidReportType Type;
-	/** Length of this report in bytes. */
-	u8 ReportLength;
+	/** Usage of the application collection the report's first field is in.
+		Devices with several functions (such as a keyboard with a mouse) 
+		give each its own application collection and report. */
+	struct HidFullUsage Application;
+	/** Length of this report in bits, not including any report id. */
+	u32 ReportLength;
 	/** The last report received (if not NULL). */
 	u8 *ReportBuffer;
+	/** Number of steps in Plan. */
+	u32 PlanLength;
+	/** Steps to decode every field of the report from ReportBuffer. */
+	struct HidExtraction *Plan;
 	/** Store the fields sequentially */
-	struct HidParserField Fields[] __attribute__((aligned(4)));
+	struct HidParserField *Fields;
 };
 
+/**
+	\brief An entry in the usage index of a parsed report descriptor.
+
+	Says which field has a usage. Entries with a Usage of 0 are empty.
+*/
+struct HidUsageIndexEntry {
+	/** The usage, or 0 if this entry is empty. */
+	struct HidFullUsage Usage;
+	/** Which field of the report has the usage. */
+	u16 Field;
+	/** For array fields, the value an element holds when the usage is 
+		active. 0 for variable fields. */
+	u16 Element;
+	/** Which report in the parser result has the field. */
+	u8 Report;
+} __attribute__((aligned(4)));
+
 /**
 	\brief A parsed report descriptor, with values.
 
 	A representation of a fully parsed report descriptor complete with value 
-	fields for easy retrieval and setting of values.
+	fields for easy retrieval and setting of values. The reports, fields, 
+	values, plans and report buffers are all stored in the same allocation 
+	after it, so it is freed with a single MemoryDeallocate.
 */
 struct HidParserResult {
 	/** Each report descriptor has an application collection with a usage */
@@ -335,6 +460,10 @@ struct HidParserResult {
 	u8 ReportCount;
 	/** The interface number that HID is available on. */
 	u8 Interface;
+	/** Number of entries in Index, a power of 2, or 0 if it is empty. */
+	u32 IndexSize;
+	/** Hash table from each usage to the field with it, for HidFindField. */
+	struct HidUsageIndexEntry *Index;
 	/** Store a pointer to each report. */
 	struct HidParserReport *Report[] __attribute__((aligned(4)));
 };
@@ -346,6 +475,38 @@ struct HidParserResult {
 */
 s32 HidGetFieldValue(struct HidParserField *field, u32 index);
 
+/**
+	\brief Returns the usage an element of an array field selects.
+
+	Array fields hold the usages of the controls active, as logical values 
+	which number the usages declared for the field, in order, from 
+	LogicalMinimum. Returns a usage of 0, meaning no control, for a value 
+	outside LogicalMinimum to LogicalMaximum or past the usages declared.
+*/
+struct HidFullUsage HidGetArrayUsage(struct HidParserField *field, s32 value);
+
+/**
+	\brief Finds the field with a usage.
+
+	Looks usage up in the index built when the report descriptor was parsed,
+	and returns the field with it, or NULL if there is none. Fields of input
+	reports are preferred, then output, then feature. If report is not NULL,
+	it is set to the report with the field. If element is not NULL, it is 
+	set to the value an element of an array field holds when the usage is 
+	active, or 0 for a variable field.
+*/
+struct HidParserField *HidFindField(struct HidParserResult *parse, struct HidFullUsage usage, 
+	struct HidParserReport **report, u32 *element);
+
+/**
+	\brief Retrieves the value of a usage.
+
+	Reads the current value of the field HidFindField finds for usage into 
+	value. For a usage in an array field, this is 1 if any element holds the
+	usage and 0 otherwise. Returns ErrorArgument if no field has the usage.
+*/
+Result HidGetUsageValue(struct HidParserResult *parse, struct HidFullUsage usage, s32 *value);
+
 
 #ifdef __cplusplus
 }
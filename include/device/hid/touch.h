@@ -17,26 +17,115 @@ extern "C"
 #endif
 
 
+#include <device/hid/report.h>
 #include <usbd/device.h>
 #include <types.h>
 
+/** The DeviceDriver field in UsbDriverDataHeader for touch devices. */
+#define DeviceDriverTouch 0x54434831
+/** The maximum number of touch devices the driver supports at once. */
+#define TouchMaxTouches 4
+/** The maximum number of contacts a touch device can report at once. */
+#define TouchMaxContacts 10
+/** The number of contact reports each touch device buffers between calls to
+	TouchGetContacts. Must be a power of 2. */
+#define TouchQueueSize 8
+
+/**
+	\brief A single contact with a touch surface.
+
+	The state of one finger (or other contact) in a touch report. Coordinates
+	are in the logical units of the device, from 0 to the maximum in the 
+	report.
+*/
+struct TouchContact {
+	/** The contact identifier reported by the device, or the contact's place
+		in the report if the device has none. Stable while the contact is 
+		down. */
+	u16 Id;
+	/** Whether or not the contact is touching. False once it lifts. */
+	bool Tip;
+	u16 X;
+	u16 Y;
+	/** Size of the contact, or 0 if the device does not report it. */
+	u16 Width;
+	u16 Height;
+};
+
+/**
+	\brief All contacts from one touch report.
+
+	Every contact in one frame of touch input, packed into the first Count 
+	entries of Contacts. A frame with no contacts means nothing is touching.
+*/
+struct TouchReport {
+	/** The address of the touch device this came from. */
+	u32 Device;
+	u32 Count;
+	/** The logical maximums of X and Y, to scale the coordinates. */
+	u16 MaximumX;
+	u16 MaximumY;
+	struct TouchContact Contacts[TouchMaxContacts];
+};
+
+/**
+	\brief The fields of one contact in the input report.
+
+	Each contact in a digitizer report is a collection beginning with a tip 
+	switch, followed by its identifier, coordinates and size. Fields that are
+	missing are NULL.
+*/
+struct TouchContactFields {
+	struct HidParserField *Tip;
+	struct HidParserField *Id;
+	struct HidParserField *X;
+	struct HidParserField *Y;
+	struct HidParserField *Width;
+	struct HidParserField *Height;
+};
+
 struct TouchEvent{
 	u16 event;
 	u16 x;
 	u16 y;
 	u16 size_x;
 	u16 size_y;	
+	/** The address of the touch device this came from. */
+	u32 device;
 };
 
 /** 
-	\brief Keyboard specific data.
+	\brief Touch specific data.
 
-	The contents of the driver data field for keyboard devices. Placed in
+	The contents of the driver data field for touch devices. Placed in
 	HidDevice, as this driver is built atop that.
 */
 struct TouchDevice {
 	/** Standard driver data header. */
 	struct UsbDriverDataHeader Header;
+	/** Internal - Index in touch arrays. */
+	u32 Index;
+	/** The input report with the contacts. */
+	struct HidParserReport *Report;
+	/** The number of contacts in Report, or NULL if every report holds all of
+		them. Devices with more contacts than fit in one report send the rest
+		in the following reports, with a contact count of 0. */
+	struct HidParserField *ContactCount;
+	/** Number of contacts in each report. */
+	u32 ContactFieldCount;
+	struct TouchContactFields ContactFields[TouchMaxContacts];
+	/** Internal - Contacts (by place in the report) down in the last one. */
+	u32 ContactsDown;
+	/** Internal - Contacts still to come in the frame being gathered. */
+	u32 ContactsExpected;
+	/** Internal - The frame being gathered. */
+	struct TouchReport Frame;
+	/** Internal - Complete frames not yet read by TouchGetContacts. */
+	struct TouchReport Queue[TouchQueueSize];
+	u32 QueueHead;
+	u32 QueueTail;
+	/** The last event returned by TouchGetEvent. */
+	struct TouchEvent Event;
 };
 
 /**
@@ -47,7 +136,49 @@ struct TouchDevice {
 	touch methods.
 */
 Result TouchAttach(struct UsbDevice *device, u32 interface);
+
+/**
+	\brief Returns the number of touch devices connected to the system.
+*/
+u32 TouchCount();
+
+/** 
+	\brief Returns the device address of the nth connected touch device.
+
+	Touch devices that are connected are stored in an array, and this method 
+	retrieves the nth item from that array. Returns 0 on error.
+*/
+u32 TouchGetAddress(u32 index);
+
+/**
+	\brief Returns whether or not any touch device is connected.
+*/
 bool TouchPersent();
+
+/**
+	\brief Checks a given touch device.
+
+	Reads back every report the touch device has sent, and queues the frames 
+	of contacts in them for TouchGetContacts.
+*/
+Result TouchPoll(u32 touchAddress);
+
+/**
+	\brief Reads the next frame of contacts from a touch device.
+
+	Polls the touch device, and copies the oldest frame of contacts it has 
+	sent into report. Returns ErrorRetry if there are none.
+*/
+Result TouchGetContacts(u32 touchAddress, struct TouchReport *report);
+
+/**
+	\brief Reads the next frame of the first contact from any touch device.
+
+	Polls every touch device in turn, and reports the first contact of the 
+	next frame from any of them, tagged with the device it came from. The 
+	contact keeps its coordinates after it is released. Returns ErrorRetry 
+	if no device has a frame.
+*/
 Result TouchGetEvent(struct TouchEvent* event);
 
 #ifdef __cplusplus
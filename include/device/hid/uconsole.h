@@ -0,0 +1,131 @@
+/******************************************************************************
+*	device/hid/uconsole.h
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/uconsole.h contains definitions relating to the uConsole
+*	multi function device, a keyboard with a built in mouse and game pad.
+******************************************************************************/
+
+#ifndef UCONSOLE_H_
+#define UCONSOLE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <device/hid/report.h>
+#include <usbd/device.h>
+#include <types.h>
+
+/** The DeviceDriver field in UsbDriverDataHeader for uConsole devices. */
+#define DeviceDriverUConsole 0x55434F31
+/** The vendor and product ids of the uConsole keyboard. */
+#define UConsoleVendorId 0x1EAF
+#define UConsoleProductId 0x0024
+/** The number of events the driver buffers between calls to
+	uConsoleReadEvents. Must be a power of 2. */
+#define UConsoleEventQueueSize 64
+
+/**
+	\brief Which function of the uConsole an event came from.
+
+	Decided by the application collection of the report the event was in.
+*/
+enum UConsoleSource {
+	UConsoleSourceOther = 0,
+	UConsoleSourceKeyboard = 1,
+	UConsoleSourceMouse = 2,
+	UConsoleSourceGamePad = 3,
+};
+
+/**
+	\brief A change in one control of the uConsole.
+
+	Keys and buttons report 1 when pressed and 0 when released, relative axes
+	report their motion, and absolute axes their new value.
+*/
+struct UConsoleEvent {
+	/** MicroTime when the report with this change was received. */
+	u64 Time;
+	enum UConsoleSource Source : 8;
+	/** Usage of the control, e.g. a keyboard key or DesktopX. */
+	struct HidFullUsage Usage;
+	s32 Value;
+};
+
+/**
+	\brief uConsole specific data.
+
+	The contents of the driver data field for the uConsole. Placed in
+	HidDevice, as this driver is built atop that.
+*/
+struct UConsoleDevice {
+	/** Standard driver data header. */
+	struct UsbDriverDataHeader Header;
+	/** Internal - Where the values of each report's fields in the last
+		report start in Values. */
+	u32 *ValueBase;
+	/** Internal - The values of every field in the last report of each
+		input report, one per array element. */
+	s32 *Values;
+	/** Internal - Events not yet read by uConsoleReadEvents. */
+	struct UConsoleEvent Events[UConsoleEventQueueSize];
+	/** Count of events added to Events. Only written when reports are
+		received. */
+	volatile u32 EventHead;
+	/** Count of events read from Events. Only written by
+		uConsoleReadEvents. */
+	volatile u32 EventTail;
+	/** Count of events lost because Events was full. */
+	volatile u32 EventOverflows;
+};
+
+/**
+	\brief Enumerates a device as a uConsole.
+
+	Attaches to a uConsole already checked by HidAttach, and builds up 
+	necessary information to enable the uConsole methods. Registered for 
+	the uConsole's vendor and product id ahead of the generic keyboard and 
+	mouse drivers, which other devices go to.
+*/
+Result uConsoleAttach(struct UsbDevice *device, u32 interface);
+
+/**
+	\brief Returns whether or not a uConsole is connected.
+*/
+bool uConsolePersent();
+
+/**
+	\brief Checks the uConsole.
+
+	Reads back every report the uConsole has sent, and queues an event for
+	each control that changed.
+*/
+Result uConsolePoll();
+
+/**
+	\brief Reads queued events from the uConsole.
+
+	Copies up to count of the oldest events found by uConsolePoll into
+	events, in the order they happened, and removes them from the queue.
+	Returns the number copied.
+*/
+u32 uConsoleReadEvents(struct UConsoleEvent *events, u32 count);
+
+/**
+	\brief Reads the next event from the uConsole.
+
+	Polls the uConsole, and copies the oldest event into event. Returns
+	ErrorRetry if there are none.
+*/
+Result uConsoleGetEvent(struct UConsoleEvent *event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -146,6 +146,35 @@ enum HubPortFeature {
 	FeatureResetChange = 20,
 };
 
+/**
+	\brief The state of a hub port.
+
+	Each port of a hub is driven through these states by HubCheckConnection,
+	which advances them on port status changes and deadlines rather than by
+	sleeping, so that one slow port does not hold up any other.
+*/
+enum HubPortState {
+	PortDisconnected = 0, // Nothing attached.
+	PortDebounce = 1, // Connected, waiting for the connection to settle.
+	PortReset = 2, // Reset signalled, waiting for the hub to enable the port.
+	PortRecovery = 3, // Reset complete, waiting before addressing the device.
+	PortEnumerate = 4, // The device is being enumerated at the default address.
+	PortEnabled = 5, // The device is enumerated and in use.
+	PortBackOff = 6, // Bringing up the port failed, waiting to try again.
+	PortFailed = 7, // Gave up on the port until the device is replugged.
+};
+
+/**
+	\brief The state machine of a hub port.
+*/
+struct HubPort {
+	enum HubPortState State : 8;
+	u8 Attempts; // Failed attempts at bringing up the port.
+	bool Changed; // The port needs checking by HubCheckForChange.
+	u64 Since; // The MicroTime at which State was entered.
+	u64 Deadline; // The MicroTime at which the port next needs attention.
+};
+
 /** The DeviceDriver field in UsbDriverDataHeader for hubs. */
 #define DeviceDriverHub 0x48554230
 
@@ -159,8 +188,13 @@ struct HubDevice {
 	struct HubFullStatus Status;
 	struct HubDescriptor *Descriptor;
 	u32 MaxChildren;
-	struct HubPortFullStatus PortStatus[MaxChildrenPerDevice];
-	struct UsbDevice *Children[MaxChildrenPerDevice];
+	struct HubPortFullStatus *PortStatus; // MaxChildren entries, after Children.
+	struct UsbDevice **Children; // MaxChildren entries, one allocation.
+	struct HubPort *Ports; // MaxChildren entries, after PortStatus.
+	struct UsbTransactionTranslator *Tts; // High speed hubs only, after Ports.
+	bool MultiTt; // If true, Tts has one entry per port, otherwise just one.
+	u32 Interface; // The interface of the status change endpoint.
+	u64 PowerGoodTime; // The MicroTime at which port power becomes good.
 };
 
 /**
@@ -184,19 +218,37 @@ Result HubAttach(struct UsbDevice *device, u32 interfaceNumber);
 /**
 	\brief Resets a port on a hub.
 
-	Resets a port on a hub. No validation.
+	Resets a port on a hub and waits for the reset to complete. No validation.
+	Used only while the port's device is being enumerated; otherwise resets are
+	driven by the port state machine in HubCheckConnection.
 */
 Result HubPortReset(struct UsbDevice *device, u8 port);
 
 /**
 	\brief Checks the connection status of a port.
 
-	Checks for a change in the connection status of a port. If it has changed
-	performs necessary actions such as enumerating a new device or deallocating
-	an old one.
+	Advances the state machine of a port. If its deadline has passed, reads
+	the port status, and on a change performs the next step: debouncing a new
+	connection, resetting the port, enumerating a new device, deallocating an
+	old one or backing off after a failure. Never sleeps, but enumeration of 
+	a new device does wait on that device's transfers.
 */
 Result HubCheckConnection(struct UsbDevice *device, u8 port);
 
+/**
+	\brief Enumerates the ports of hubs waiting on power good.
+
+	Hubs attached while another hub is being enumerated only switch on their
+	ports and queue themselves, so that the power good delays of sibling hubs
+	elapse together. Each pass checks every port of every queued hub, then
+	drops the hubs whose ports have all settled and sleeps until the earliest
+	power good time or port deadline of the rest. Returns once the queue is
+	empty, or after a bounded number of passes, leaving any ports still 
+	settling to HubCheckForChange. Enumerating a hub may queue further hubs,
+	which join the next pass.
+*/
+void HubEnumeratePending();
+
 /**
 	\brief Checks all hubs for new devices.
 
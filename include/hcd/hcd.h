@@ -80,6 +80,15 @@ Result HcdSumbitInterruptTransfer(struct UsbDevice *device,
 	struct UsbPipeAddress pipe, void* buffer, u32 bufferLength,
 	struct UsbDeviceRequest *request);
 
+/**
+	\brief Returns the current frame number.
+
+	Returns the number of the (micro)frame the host is currently in, which
+	counts (micro)frames since the host was started modulo some power of 2. 
+	Only differences between two values are meaningful.
+*/
+u32 HcdGetFrameNumber();
+
 #include "dwc/designware20.h"
 
 #ifdef __cplusplus
@@ -9,3 +9,11 @@
 ******************************************************************************/
 #include <types.h>
 #include <platform/none/byteorder.h>
+
+/**
+	\brief Orders memory accesses either side of it.
+
+	Data memory barrier, as the CP15 operation of ARMv6. Used to publish data
+	between a producer in interrupt context and a consumer without locks.
+*/
+#define MemoryBarrier() __asm__ __volatile__ ("mcr p15, 0, %0, c7, c10, 5" : : "r" (0) : "memory")
@@ -85,8 +85,64 @@ void LogPrintF(char* format, u32 formatLength, ...);
 #define LOGL(x, len) (LogPrint(x, len))
 #define LOGF(x, ...) (LogPrintF(x, sizeof(x), __VA_ARGS__))
 #define LOGFL(x, len, ...) (LogPrintF(x, len, __VA_ARGS__))
+
+/**
+	\brief State of a rate limited log message.
+
+	Each call site of a rate limited message keeps one of these statically. 
+	Must initially be zero.
+*/
+struct LogRate {
+	u64 Window;
+	u32 Count;
+	u32 Suppressed;
+};
+
+/**
+	\brief Decides if a rate limited message may be printed.
+
+	Returns true at most LOG_RATE_BURST times every LOG_RATE_INTERVAL 
+	microseconds, and false otherwise. When a new interval begins, reports how
+	many messages were suppressed in the last. Implemented in platform.c.
+*/
+bool LogRateLimit(struct LogRate *rate);
+#endif
+
+#define LogLevelNone 0
+#define LogLevelError 1
+#define LogLevelWarning 2
+#define LogLevelInfo 3
+#define LogLevelDebug 4
+#define LogLevelTrace 5
+
+// Source files may define LOG_MODULE_LEVEL before their first include to log
+// at the level of their module (e.g. HID_LOG_LEVEL), rather than LOG_LEVEL.
+#ifndef LOG_MODULE_LEVEL
+#define LOG_MODULE_LEVEL LOG_LEVEL
 #endif
-#ifdef DEBUG
+
+#if !defined NO_LOG && LOG_MODULE_LEVEL >= LogLevelError
+#define LOG_ERROR(x) LOG(x)
+#define LOG_ERRORF(x, ...) LOGF(x, __VA_ARGS__)
+#else
+#define LOG_ERROR(x) 
+#define LOG_ERRORF(x, ...) 
+#endif
+#if !defined NO_LOG && LOG_MODULE_LEVEL >= LogLevelWarning
+#define LOG_WARNING(x) do { static struct LogRate logRate; if (LogRateLimit(&logRate)) LOG(x); } while (false)
+#define LOG_WARNINGF(x, ...) do { static struct LogRate logRate; if (LogRateLimit(&logRate)) LOGF(x, __VA_ARGS__); } while (false)
+#else
+#define LOG_WARNING(x) 
+#define LOG_WARNINGF(x, ...) 
+#endif
+#if !defined NO_LOG && LOG_MODULE_LEVEL >= LogLevelInfo
+#define LOG_INFO(x) LOG(x)
+#define LOG_INFOF(x, ...) LOGF(x, __VA_ARGS__)
+#else
+#define LOG_INFO(x) 
+#define LOG_INFOF(x, ...) 
+#endif
+#if defined DEBUG && LOG_MODULE_LEVEL >= LogLevelDebug
 #define LOG_DEBUG(x) LOG(x)
 #define LOG_DEBUGL(x, len) LOGL(x, len)
 #define LOG_DEBUGF(x, ...) LOGF(x, __VA_ARGS__)
@@ -97,6 +153,13 @@ void LogPrintF(char* format, u32 formatLength, ...);
 #define LOG_DEBUGF(x, ...) 
 #define LOG_DEBUGFL(x, len, ...) 
 #endif
+#if defined DEBUG && LOG_MODULE_LEVEL >= LogLevelTrace
+#define LOG_TRACE(x) LOG(x)
+#define LOG_TRACEF(x, ...) LOGF(x, __VA_ARGS__)
+#else
+#define LOG_TRACE(x) 
+#define LOG_TRACEF(x, ...) 
+#endif
 
 /**
 	\brief Turns on the USB host controller.
@@ -118,6 +181,16 @@ void PowerOffUsb();
 */
 void MicroDelay(u32 delay);
 
+/**
+	\brief Gets the current time in microseconds.
+
+	Returns the value of a free running microsecond counter. Used to wait on
+	deadlines without blocking, so that several slow operations (such as hub
+	power good delays) can elapse concurrently. Only differences between two
+	values are meaningful.
+*/
+u64 MicroTime();
+
 
 #ifdef ARM
 #	ifdef ARM_V6
@@ -23,14 +23,11 @@ extern "C"
 	\brief The maximum number of children a device could have, by implication, this is 
 	the maximum number of ports a hub supports. 
 	
-	This is theoretically 255, as 8 bits are used to transfer the port count in
-	a hub descriptor. Practically, no hub has more than 10, so we instead allow 
-	that many. Increasing this number will waste space, but will not have 
-	adverse consequences up to 255. Decreasing this number will save a little 
-	space in the HubDevice structure, at the risk of removing support for an 
-	otherwise valid hub. 
+	This is 255, as 8 bits are used to transfer the port count in a hub 
+	descriptor. Hubs size their child and port status storage from their own 
+	descriptor, so this is only an upper bound and costs no space.
 */
-#define MaxChildrenPerDevice 10
+#define MaxChildrenPerDevice 255
 /** 
 	\brief The maximum number of interfaces a device configuration could have. 
 
@@ -100,6 +97,24 @@ struct UsbDriverDataHeader {
 	u32 DataSize;
 };
 
+/**
+	\brief A transaction translator of a high speed hub.
+
+	High speed hubs talk to full and low speed devices through transaction 
+	translators (TTs). A single TT hub shares one between all of its ports, a 
+	multi TT hub has one per port. All periodic (interrupt and isochronous) 
+	traffic through a TT must fit in one full speed frame, so it is budgeted
+	here in full speed byte times per frame.
+*/
+struct UsbTransactionTranslator {
+	struct UsbDevice *Hub;
+	u16 ThinkTime; // Full speed bit times the TT needs between transactions.
+	u16 PeriodicLoad; // Full speed byte times per frame reserved by devices.
+};
+
+/** The full speed byte times per frame that periodic traffic may use (90%). */
+#define TransactionTranslatorPeriodicLimit 1350
+
 /**
 	\brief Structure to store the details of a USB device that has been 
 	detectd.
@@ -139,6 +154,16 @@ struct UsbDevice {
 	volatile void *FullConfiguration;
 	volatile struct UsbDriverDataHeader *DriverData;
 	volatile u32 LastTransfer;
+	/** The TT through which a full or low speed device is reached, or NULL. */
+	struct UsbTransactionTranslator *Tt;
+	/** The port of the TT's hub leading to this device (1 based). */
+	u8 TtPort;
+	/** The periodic load this device has reserved in its TT. */
+	u16 TtLoad;
+	/** Next data toggle of each interrupt endpoint. Bit n is IN endpoint n, bit n + 16 OUT endpoint n, set for DATA1. */
+	volatile u32 DataToggle;
+	/** Set if this device, or a device below it, needs checking by UsbCheckForChange. */
+	volatile bool Changed;
 };
 
 #define InterfaceClassAttachCount 16
@@ -30,7 +30,9 @@ extern "C"
 	physical properties. In other words, we identify the pipe by its physical 
 	consequences on the USB. This is similar to Linux, and vastly reduces 
 	complication, at the expense of requiring a little more sophistication on the
-	sender's behalf. 
+	sender's behalf. MaxSize only describes packets of up to 64 bytes, so
+	endpoints with larger packets also give their exact maximum packet size 
+	in PacketSize.
 */
 struct UsbPipeAddress {
 	UsbPacketSize MaxSize : 2; // @0
@@ -39,7 +41,8 @@ struct UsbPipeAddress {
 	unsigned Device : 8; // @8
 	UsbTransfer Type : 2; // @16
 	UsbDirection Direction : 1; // @18
-	unsigned _reserved19_31 : 13; // @19
+	unsigned PacketSize : 11; // @19 (exact maximum packet size, if not 0)
+	unsigned _reserved30_31 : 2; // @30
 } __attribute__ ((__packed__));
 
 
@@ -54,6 +54,43 @@ Result UsbControlMessage(struct UsbDevice *device,
 	struct UsbPipeAddress pipe, void* buffer, u32 bufferLength,
 	struct UsbDeviceRequest *request, u32 timeout);
 
+/**
+	\brief Sends an interrupt transfer synchronously to a given device.
+
+	Performs one transfer on an interrupt endpoint of a device, then waits for
+	completion. The request is only used for diagnostics and may be NULL. If
+	the endpoint has no data (NAK), returns ErrorRetry. The data toggle of 
+	the endpoint is tracked in the device.
+*/
+Result UsbInterruptMessage(struct UsbDevice *device, 
+	struct UsbPipeAddress pipe, void* buffer, u32 bufferLength,
+	struct UsbDeviceRequest *request, u32 timeout);
+
+/**
+	\brief Marks a device as needing to be checked for changes.
+
+	Sets the Changed flag of the device and every device above it, so that 
+	the next UsbCheckForChange visits it.
+*/
+void UsbMarkChanged(struct UsbDevice *device);
+
+/**
+	\brief Returns the current frame number of the host.
+
+	Returns the number of the (micro)frame the host controller is in. Used to
+	timestamp transfers relative to the bus schedule.
+*/
+u32 UsbGetFrameNumber();
+
+/**
+	\brief Selects an alternate setting of an interface.
+
+	Sends a SetInterface request to a configured device, selecting the given
+	alternate setting of the given interface. The interface and endpoint 
+	descriptors stored in the device are not updated.
+*/
+Result UsbSetInterface(struct UsbDevice *device, u8 interface, u8 alternate);
+
 /**
 	\brief Allocates memory to a new device.
 
@@ -101,10 +138,11 @@ const char* UsbGetDescription(struct UsbDevice *device);
 struct UsbDevice *UsbGetRootHub();
 
 /**
-	\brief Scans the entire USB tree for changes.
+	\brief Scans the USB tree for changes.
 
-	Recursively calls HubCheckConnection on all ports on all hubs connected to 
-	the root hub.
+	Asks the root hub to check for changes. Hubs poll their status change 
+	endpoints and mark themselves as changed, and only the subtrees that have
+	changed are visited. Hubs sweep all of their ports periodically too.
 */
 void UsbCheckForChange();
 
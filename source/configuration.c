@@ -39,6 +39,12 @@ void KbdLoad();
 #ifdef LIB_MOUSE
 void MouseLoad();
 #endif
+#ifdef LIB_UCONSOLE
+void uConsoleLoad();
+#endif
+#ifdef LIB_GAMEPAD
+void GamePadLoad();
+#endif
 void TouchLoad();
 
 void ConfigurationLoad() {
@@ -70,5 +76,8 @@ void ConfigurationLoad() {
 #ifdef LIB_UCONSOLE
 	uConsoleLoad();
 #endif 
+#ifdef LIB_GAMEPAD
+	GamePadLoad();
+#endif
 	TouchLoad();
 }
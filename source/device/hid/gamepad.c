@@ -0,0 +1,377 @@
+/******************************************************************************
+*	device/hid/gamepad.c
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/gamepad.c contains code relating to USB hid game pads and
+*	joysticks. The driver finds the axes, hat switches and buttons in the
+*	parsed report descriptor when the device is attached, so that each report
+*	only needs its values scaled into the state of the game pad.
+******************************************************************************/
+#include <device/hid/hid.h>
+#include <device/hid/gamepad.h>
+#include <device/hid/input.h>
+#include <device/hid/report.h>
+#include <platform/platform.h>
+#include <types.h>
+#include <usbd/device.h>
+#include <usbd/usbd.h>
+
+u32 gamePadCount __attribute__((aligned(4))) = 0;
+u32 gamePadAddresses[GamePadMaxGamePads] = { 0, 0, 0, 0 };
+struct UsbDevice* gamePads[GamePadMaxGamePads];
+
+void GamePadLoad()
+{
+	LOG_DEBUG("CSUD: Game pad driver version 0.1\n");
+	gamePadCount = 0;
+	for (u32 i = 0; i < GamePadMaxGamePads; i++)
+	{
+		gamePadAddresses[i] = 0;
+		gamePads[i] = NULL;
+	}
+	HidRegisterDriver(GenericDesktopControl, DesktopJoystick, 0, 0, HidPriorityGeneric, GamePadAttach);
+	HidRegisterDriver(GenericDesktopControl, DesktopGamePad, 0, 0, HidPriorityGeneric, GamePadAttach);
+}
+
+u32 GamePadIndex(u32 address) {
+	if (address == 0) return 0xffffffff;
+
+	for (u32 i = 0; i < GamePadMaxGamePads; i++)
+		if (gamePadAddresses[i] == address)
+			return i;
+
+	return 0xffffffff;
+}
+
+u32 GamePadGetAddress(u32 index) {
+	if (index > gamePadCount) return 0;
+
+	for (u32 i = 0; i < GamePadMaxGamePads; i++) {
+		if (gamePadAddresses[i] != 0)
+			if (index-- == 0)
+				return gamePadAddresses[i];
+	}
+
+	return 0;
+}
+
+u32 GamePadCount() {
+	return gamePadCount;
+}
+
+void GamePadDetached(struct UsbDevice *device) {
+	struct GamePadDevice *data;
+
+	data = (struct GamePadDevice*)HidGetDriverData(device, DeviceDriverGamePad);
+	if (data != NULL) {
+		if (gamePadAddresses[data->Index] == device->Number) {
+			gamePadAddresses[data->Index] = 0;
+			gamePadCount--;
+			gamePads[data->Index] = NULL;
+		}
+	}
+}
+
+void GamePadDeallocate(struct UsbDevice *device) {
+	struct GamePadDevice *data;
+
+	data = (struct GamePadDevice*)HidGetDriverData(device, DeviceDriverGamePad);
+	if (data != NULL) {
+		HidUnbindDriver(device, DeviceDriverGamePad);
+		MemoryDeallocate(data);
+	}
+}
+
+/**
+	\brief Finds the controls in an input report.
+
+	Records the axis, hat switch and button fields of report in data, with
+	what is needed to scale each axis. Fields with no range are skipped.
+	Returns the number of controls found.
+*/
+u32 GamePadFindControls(struct GamePadDevice *data, struct HidParserReport *report) {
+	struct HidParserField *field;
+	struct GamePadAxisField *axis;
+	u32 axes;
+	u16 usage;
+
+	axes = 0;
+	data->AxisCount = data->HatCount = data->ButtonCount = 0;
+	for (u32 i = 0; i < report->FieldCount; i++) {
+		field = &report->Fields[i];
+		if (!field->Attributes.Variable || field->Attributes.Constant ||
+			field->LogicalMaximum <= field->LogicalMinimum)
+			continue;
+		usage = (u16)field->Usage.Desktop;
+		switch (field->Usage.Page) {
+		case GenericDesktopControl:
+			if (usage >= DesktopX && usage <= DesktopDial) {
+				if ((axes & (1 << (usage - DesktopX))) != 0)
+					break;
+				axes |= 1 << (usage - DesktopX);
+				axis = &data->Axes[data->AxisCount++];
+				axis->Field = field;
+				axis->Axis = (enum GamePadAxis)(usage - DesktopX);
+				axis->Minimum = field->LogicalMinimum;
+				axis->Scale = 0xfffe0000 / (u32)(field->LogicalMaximum - field->LogicalMinimum) + 1;
+			} else if (usage == DesktopHatSwitch && data->HatCount < GamePadMaxHats)
+				data->Hats[data->HatCount++] = field;
+			break;
+		case Button:
+			if (usage >= 1 && usage <= GamePadMaxButtons && data->ButtonCount < GamePadMaxButtons) {
+				data->Buttons[data->ButtonCount] = field;
+				data->ButtonBits[data->ButtonCount++] = usage - 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return data->AxisCount + data->HatCount + data->ButtonCount;
+}
+
+/**
+	\brief Returns the value of an axis, normalised to -32767 to 32767.
+*/
+s16 GamePadNormaliseAxis(struct GamePadAxisField *axis) {
+	s32 value;
+
+	value = (s32)(((s64)(axis->Field->Value.S32 - axis->Minimum) * axis->Scale) >> 16) - 32767;
+	return Max(Min(value, 32767, s32), -32767, s32);
+}
+
+/**
+	\brief Returns the direction of a hat switch.
+
+	Hats report one of their logical values for each direction, starting
+	with up and going clockwise, and any value out of range when they are
+	not pressed. Hats with 4 positions only report the main directions.
+*/
+s8 GamePadHatDirection(struct HidParserField *field) {
+	s32 position, positions;
+
+	position = field->Value.S32 - field->LogicalMinimum;
+	positions = field->LogicalMaximum - field->LogicalMinimum + 1;
+	if (position < 0 || position >= positions)
+		return GamePadHatCentred;
+	return position * 8 / positions;
+}
+
+/**
+	\brief Queues an event.
+
+	Adds an event to the queue, or counts it as lost if the queue is full.
+	Only called when reports are received, so there is only ever one writer.
+*/
+void GamePadQueueEvent(struct GamePadDevice *data, u64 time, enum GamePadControl control, u8 index, s16 value) {
+	struct GamePadEvent *event;
+	u32 head;
+
+	head = data->EventHead;
+	if (head - data->EventTail >= GamePadEventQueueSize) {
+		data->EventOverflows++;
+		return;
+	}
+
+	event = &data->Events[head & (GamePadEventQueueSize - 1)];
+	event->Time = time;
+	event->Control = control;
+	event->Index = index;
+	event->Value = value;
+	MemoryBarrier();
+	data->EventHead = head + 1;
+}
+
+void GamePadReportReceived(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct GamePadDevice *data;
+	struct GamePadState *state;
+	struct HidParserField *field;
+	u32 buttons, changed;
+	u64 time;
+	s16 value;
+	u8 bit;
+
+	data = (struct GamePadDevice*)HidGetDriverData(device, DeviceDriverGamePad);
+	if (data == NULL || report != data->Report)
+		return;
+	time = record != NULL ? record->Time : MicroTime();
+	state = &data->State;
+
+	for (u32 i = 0; i < data->AxisCount; i++) {
+		field = data->Axes[i].Field;
+		value = GamePadNormaliseAxis(&data->Axes[i]);
+		if (value == state->Axes[data->Axes[i].Axis])
+			continue;
+		state->Axes[data->Axes[i].Axis] = value;
+		state->AxesChanged |= 1 << data->Axes[i].Axis;
+		GamePadQueueEvent(data, time, GamePadControlAxis, data->Axes[i].Axis, value);
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(field->Usage.Page, field->Usage.Desktop), field->Value.S32, time);
+	}
+
+	for (u32 i = 0; i < data->HatCount; i++) {
+		value = GamePadHatDirection(data->Hats[i]);
+		if (value == state->Hats[i])
+			continue;
+		state->Hats[i] = value;
+		state->HatsChanged |= 1 << i;
+		GamePadQueueEvent(data, time, GamePadControlHat, i, value);
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(GenericDesktopControl, DesktopHatSwitch), value, time);
+	}
+
+	buttons = 0;
+	for (u32 i = 0; i < data->ButtonCount; i++)
+		buttons |= (u32)(data->Buttons[i]->Value.U32 != 0) << data->ButtonBits[i];
+	changed = buttons ^ state->Buttons;
+	for (u32 i = 0; changed != 0 && i < data->ButtonCount; i++) {
+		bit = data->ButtonBits[i];
+		if ((changed & ((u32)1 << bit)) == 0)
+			continue;
+		changed &= ~((u32)1 << bit);
+		GamePadQueueEvent(data, time, GamePadControlButton, bit, (buttons >> bit) & 1);
+		InputPublish(device->Number, InputEventKey, HidUsage(Button, bit + 1), (buttons >> bit) & 1, time);
+	}
+	state->ButtonsChanged |= buttons ^ state->Buttons;
+	state->Buttons = buttons;
+	InputSync(device->Number, time);
+}
+
+Result GamePadAttach(struct UsbDevice *device, u32 interface) {
+	struct HidDevice *hidData;
+	struct HidBinding *binding;
+	struct GamePadDevice *data;
+	struct HidParserResult *parse;
+	struct HidParserReport *report;
+	u32 count, best, gamePadNumber;
+
+	if (gamePadCount == GamePadMaxGamePads) {
+		LOGF("GAMEPAD: %s not connected. Too many game pads connected (%d/%d). Change GamePadMaxGamePads in device/hid/gamepad.h to allow more.\n", UsbGetDescription(device), gamePadCount, GamePadMaxGamePads);
+		return ErrorIncompatible;
+	}
+
+	hidData = (struct HidDevice*)device->DriverData;
+	if (hidData->Header.DeviceDriver != DeviceDriverHid) {
+		LOGF("GAMEPAD: %s isn't a HID device. The game pad driver is built upon the HID driver.\n", UsbGetDescription(device));
+		return ErrorIncompatible;
+	}
+
+	parse = hidData->ParserResult;
+	if (hidData->Application != HidUsage(GenericDesktopControl, DesktopJoystick) &&
+		hidData->Application != HidUsage(GenericDesktopControl, DesktopGamePad)) {
+		LOGF("GAMEPAD: %s doesn't seem to be a game pad...\n", UsbGetDescription(device));
+		return ErrorIncompatible;
+	}
+
+	if ((data = MemoryAllocate(sizeof(struct GamePadDevice))) == NULL) {
+		LOGF("GAMEPAD: Not enough memory to allocate game pad %s.\n", UsbGetDescription(device));
+		return ErrorMemory;
+	}
+	MemorySet(data, 0, sizeof(struct GamePadDevice));
+
+	// Use the input report of this collection with the most controls.
+	best = 0;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		report = parse->Report[i];
+		if (report->Type != Input ||
+			HidUsage(report->Application.Page, report->Application.Desktop) != hidData->Application)
+			continue;
+		if ((count = GamePadFindControls(data, report)) > best) {
+			best = count;
+			data->Report = report;
+		}
+	}
+	if (best == 0) {
+		LOGF("GAMEPAD: %s has no axes, hat switches or buttons.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+	GamePadFindControls(data, data->Report);
+	data->Header.DeviceDriver = DeviceDriverGamePad;
+	data->Header.DataSize = sizeof(struct GamePadDevice);
+	for (u32 i = 0; i < GamePadMaxHats; i++)
+		data->State.Hats[i] = GamePadHatCentred;
+	if ((binding = HidBindDriver(device, (struct UsbDriverDataHeader*)data)) == NULL) {
+		LOGF("GAMEPAD: %s not connected. Too many drivers bound to it.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+
+	data->Index = gamePadNumber = 0xffffffff;
+	for (u32 i = 0; i < GamePadMaxGamePads; i++) {
+		if (gamePadAddresses[i] == 0) {
+			data->Index = gamePadNumber = i;
+			gamePadAddresses[i] = device->Number;
+			gamePadCount++;
+			break;
+		}
+	}
+
+	if (gamePadNumber == 0xffffffff) {
+		LOG("GAMEPAD: PANIC! Driver in inconsistent state! GamePadCount is inaccurate.\n");
+		GamePadDeallocate(device);
+		return ErrorGeneral;
+	}
+
+	gamePads[gamePadNumber] = device;
+	binding->HidDetached = GamePadDetached;
+	binding->HidDeallocate = GamePadDeallocate;
+	binding->HidReportReceived = GamePadReportReceived;
+	LOG_DEBUGF("GAMEPAD: New game pad assigned %d with %d axes, %d hats and %d buttons in report %d!\n",
+		device->Number, data->AxisCount, data->HatCount, data->ButtonCount, data->Report->Id);
+
+	return OK;
+}
+
+Result GamePadPoll(u32 gamePadAddress) {
+	u32 gamePadNumber;
+	Result result;
+	struct GamePadDevice *data;
+
+	gamePadNumber = GamePadIndex(gamePadAddress);
+	if (gamePadNumber == 0xffffffff) return ErrorDisconnected;
+	data = (struct GamePadDevice*)HidGetDriverData(gamePads[gamePadNumber], DeviceDriverGamePad);
+	if ((result = HidReadDevice(gamePads[gamePadNumber], data->Report->Index)) != OK) {
+		if (result == ErrorRetry)
+			return OK;
+		if (result != ErrorDisconnected)
+			LOG_WARNINGF("GAMEPAD: Could not get game pad report from %s.\n", UsbGetDescription(gamePads[gamePadNumber]));
+		return result;
+	}
+
+	// Every report drained is decoded by GamePadReportReceived.
+	return OK;
+}
+
+Result GamePadGetState(u32 gamePadAddress, struct GamePadState *state) {
+	u32 gamePadNumber;
+	struct GamePadDevice *data;
+
+	gamePadNumber = GamePadIndex(gamePadAddress);
+	if (gamePadNumber == 0xffffffff) return ErrorDisconnected;
+	data = (struct GamePadDevice*)HidGetDriverData(gamePads[gamePadNumber], DeviceDriverGamePad);
+	MemoryCopy(state, &data->State, sizeof(struct GamePadState));
+	data->State.AxesChanged = data->State.HatsChanged = 0;
+	data->State.ButtonsChanged = 0;
+	return OK;
+}
+
+u32 GamePadReadEvents(u32 gamePadAddress, struct GamePadEvent *events, u32 count) {
+	u32 gamePadNumber;
+	struct GamePadDevice *data;
+	u32 head, tail, read;
+
+	gamePadNumber = GamePadIndex(gamePadAddress);
+	if (gamePadNumber == 0xffffffff) return 0;
+	data = (struct GamePadDevice*)HidGetDriverData(gamePads[gamePadNumber], DeviceDriverGamePad);
+
+	tail = data->EventTail;
+	head = data->EventHead;
+	MemoryBarrier();
+	for (read = 0; read < count && tail != head; read++, tail++)
+		MemoryCopy(&events[read], &data->Events[tail & (GamePadEventQueueSize - 1)], sizeof(struct GamePadEvent));
+	MemoryBarrier();
+	data->EventTail = tail;
+	return read;
+}
@@ -13,6 +13,7 @@
 *	deal with these reports. More abstracted drivers for keyboards and mice and
 *	whatnot would no doubt be very useful.
 ******************************************************************************/
+#define LOG_MODULE_LEVEL HID_LOG_LEVEL
 #include <device/hid/hid.h>
 #include <device/hid/report.h>
 #include <platform/platform.h>
@@ -22,25 +23,254 @@
 #include <usbd/usbd.h>
 
 #define HidMessageTimeout 16
+#define HidUsageStackSize 16
+/** Room past the end of a report buffer for the report id and plan loads. */
+#define HidReportPadding 5
+/** The most distinct reports a report descriptor may declare. */
+#define HidMaxReports 32
+/** Rounds a size in the parse result arena up to keep words aligned. */
+#define HidArenaAlign(size) (((size) + 3) & ~3)
+/** Moves a pointer into a parse result arena to the same place in a copy. */
+#define HidArenaRelocate(pointer, delta) ((void*)((u8*)(pointer) + (delta)))
+/** The number of parsed report descriptors kept for reuse. */
+#define HidParseCacheSize 4
+/** The most usages put in the usage index for one array field. */
+#define HidIndexArrayMax 1024
+/** The usage index key of a usage: its page and usage as one word. */
+#define HidUsageKey(usage) (*(u32*)&(usage))
 
-Result (*HidUsageAttach[HidUsageAttachCount])(struct UsbDevice *device, u32 interfaceNumber);
+/**
+	\brief A parsed report descriptor kept for reuse.
+
+	Template is a pristine copy of the parse result arena of Size bytes, 
+	followed by the Length byte raw report descriptor it was parsed from. 
+	Devices of the same model with the same descriptor get a copy of the 
+	template instead of parsing the descriptor again.
+*/
+struct HidParseCacheEntry {
+	u32 Hash;
+	u16 VendorId;
+	u16 ProductId;
+	u16 Length;
+	u32 Size;
+	u32 LastUsed;
+	struct HidParserResult *Template;
+};
+
+struct HidParseCacheEntry hidParseCache[HidParseCacheSize];
+u32 hidParseCacheClock = 0;
+
+/**
+	\brief A driver registered with HidRegisterDriver.
+
+	Application is the extended usage of the collections the driver is for,
+	and VendorId and ProductId, if not 0, the devices.
+*/
+struct HidDriver {
+	u32 Application;
+	u16 VendorId;
+	u16 ProductId;
+	u8 Priority;
+	Result (*Attach)(struct UsbDevice *device, u32 interfaceNumber);
+};
+
+/** The registered drivers, highest priority first. */
+struct HidDriver hidDrivers[HidMaxDrivers];
+u32 hidDriverCount = 0;
+struct UsbDevice *hidDevices[HidMaxDevices];
+
+/** The report descriptor of a boot keyboard, from appendix B of the hid
+	specification. Input fields 0 to 7 are the modifiers, and 9 the keys. */
+u8 hidBootKeyboardDescriptor[] = {
+	0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7,
+	0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+	0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+	0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+	0x81, 0x00, 0xc0,
+};
+/** The report descriptor of a boot mouse, from appendix B of the hid
+	specification. Input fields 0 to 2 are the buttons, and 4 and 5 the X 
+	and Y axes. */
+u8 hidBootMouseDescriptor[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09,
+	0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+	0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+	0x09, 0x31, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+	0xc0, 0xc0,
+};
 
 void HidLoad() 
 {
 	LOG_DEBUG("CSUD: HID driver version 0.1\n"); 
+	hidDriverCount = 0;
+	for (u32 i = 0; i < HidMaxDevices; i++)
+		hidDevices[i] = NULL;
 	InterfaceClassAttach[InterfaceClassHid] = HidAttach;
 }
 
-Result HidGetReport(struct UsbDevice *device, u8 endPoint, enum HidReportType reportType, 
+Result HidRegisterDriver(u16 page, u16 usage, u16 vendorId, u16 productId, u8 priority, 
+	Result (*attach)(struct UsbDevice *device, u32 interfaceNumber)) {
+	u32 i;
+
+	if (hidDriverCount == HidMaxDrivers) {
+		LOGF("HID: Cannot register a driver for usage %x:%x. Change HidMaxDrivers in device/hid/hid.h to allow more.\n", page, usage);
+		return ErrorMemory;
+	}
+
+	for (i = hidDriverCount; i > 0 && hidDrivers[i - 1].Priority < priority; i--)
+		hidDrivers[i] = hidDrivers[i - 1];
+	hidDrivers[i].Application = HidUsage(page, usage);
+	hidDrivers[i].VendorId = vendorId;
+	hidDrivers[i].ProductId = productId;
+	hidDrivers[i].Priority = priority;
+	hidDrivers[i].Attach = attach;
+	hidDriverCount++;
+	return OK;
+}
+
+struct HidBinding *HidBindDriver(struct UsbDevice *device, struct UsbDriverDataHeader *driverData) {
+	struct HidDevice *data;
+	struct HidBinding *binding;
+
+	data = (struct HidDevice*)device->DriverData;
+	for (u32 i = 0; i < HidMaxBindings; i++) {
+		binding = &data->Bindings[i];
+		if (binding->DriverData == NULL) {
+			MemorySet(binding, 0, sizeof(struct HidBinding));
+			binding->Application = data->Application;
+			binding->DriverData = driverData;
+			return binding;
+		}
+	}
+	return NULL;
+}
+
+void HidUnbindDriver(struct UsbDevice *device, u32 driver) {
+	struct HidBinding *binding;
+
+	if ((binding = HidGetBinding(device, driver)) != NULL)
+		MemorySet(binding, 0, sizeof(struct HidBinding));
+}
+
+struct HidBinding *HidGetBinding(struct UsbDevice *device, u32 driver) {
+	struct HidDevice *data;
+
+	if (device->DriverData == NULL || device->DriverData->DeviceDriver != DeviceDriverHid)
+		return NULL;
+	data = (struct HidDevice*)device->DriverData;
+	for (u32 i = 0; i < HidMaxBindings; i++)
+		if (data->Bindings[i].DriverData != NULL &&
+			data->Bindings[i].DriverData->DeviceDriver == driver)
+			return &data->Bindings[i];
+	return NULL;
+}
+
+/**
+	\brief Claims a free subscription on a device.
+
+	Returns a cleared subscription of device for report, or NULL if device 
+	has none free.
+*/
+struct HidSubscription *HidSubscribe(struct UsbDevice *device, struct HidParserReport *report) {
+	struct HidDevice *data;
+	struct HidSubscription *subscription;
+
+	data = (struct HidDevice*)device->DriverData;
+	for (u32 i = 0; i < HidMaxSubscriptions; i++) {
+		subscription = &data->Subscriptions[i];
+		if (subscription->Report == NULL) {
+			MemorySet(subscription, 0, sizeof(struct HidSubscription));
+			subscription->Report = report;
+			data->SubscriptionCount++;
+			return subscription;
+		}
+	}
+	return NULL;
+}
+
+Result HidSubscribeReport(struct UsbDevice *device, u8 reportId, 
+	void (*callback)(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record, void *context), 
+	void *context) {
+	struct HidParserResult *parse;
+	struct HidSubscription *subscription;
+
+	if (device->DriverData == NULL || device->DriverData->DeviceDriver != DeviceDriverHid)
+		return ErrorDevice;
+	parse = ((struct HidDevice*)device->DriverData)->ParserResult;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		if (parse->Report[i]->Type != Input || parse->Report[i]->Id != reportId)
+			continue;
+		if ((subscription = HidSubscribe(device, parse->Report[i])) == NULL)
+			return ErrorMemory;
+		subscription->ReportCallback = callback;
+		subscription->Context = context;
+		return OK;
+	}
+	return ErrorArgument;
+}
+
+Result HidSubscribeUsage(struct UsbDevice *device, u32 usage, 
+	void (*callback)(struct UsbDevice *device, u32 usage, s32 value, u64 time, void *context), 
+	void *context) {
+	struct HidSubscription *subscription;
+	struct HidParserReport *report;
+	struct HidParserField *field;
+	struct HidFullUsage fullUsage;
+	u32 element;
+
+	if (device->DriverData == NULL || device->DriverData->DeviceDriver != DeviceDriverHid)
+		return ErrorDevice;
+	fullUsage.Page = (enum HidUsagePage)(usage >> 16);
+	fullUsage.Desktop = (enum HidUsagePageDesktop)(usage & 0xffff);
+	if ((field = HidFindField(((struct HidDevice*)device->DriverData)->ParserResult, fullUsage, &report, &element)) == NULL ||
+		report->Type != Input)
+		return ErrorArgument;
+	if ((subscription = HidSubscribe(device, report)) == NULL)
+		return ErrorMemory;
+	subscription->Field = field;
+	subscription->Element = element;
+	subscription->Usage = usage;
+	subscription->UsageCallback = callback;
+	subscription->Context = context;
+	return OK;
+}
+
+void HidUnsubscribe(struct UsbDevice *device, void *context) {
+	struct HidDevice *data;
+
+	if (device->DriverData == NULL || device->DriverData->DeviceDriver != DeviceDriverHid)
+		return;
+	data = (struct HidDevice*)device->DriverData;
+	for (u32 i = 0; i < HidMaxSubscriptions; i++)
+		if (data->Subscriptions[i].Report != NULL && data->Subscriptions[i].Context == context) {
+			MemorySet(&data->Subscriptions[i], 0, sizeof(struct HidSubscription));
+			data->SubscriptionCount--;
+		}
+}
+
+struct UsbDriverDataHeader *HidGetDriverData(struct UsbDevice *device, u32 driver) {
+	struct HidBinding *binding;
+
+	binding = HidGetBinding(device, driver);
+	return binding != NULL ? binding->DriverData : NULL;
+}
+
+struct UsbDevice *HidGetDevice(u32 index) {
+	if (index >= HidMaxDevices) return NULL;
+	return hidDevices[index];
+}
+
+Result HidGetReport(struct UsbDevice *device, enum HidReportType reportType, 
 	u8 reportId, u8 interface, u32 bufferLength, void* buffer) {
 	Result result;
-	//LOGF("%s: TYPE:%d ID:%d INTERFACE:%d LEN:%d\n", __func__, reportType, reportId, interface, bufferLength);	
-	if ((result = UsbInterruptMessage(
+	
+	if ((result = UsbControlMessage(
 		device, 
 		(struct UsbPipeAddress) { 
 			.Type = Control, 
 			.Speed = device->Speed, 
-			.EndPoint = endPoint , 
+			.EndPoint = 0 , 
 			.Device = device->Number, 
 			.Direction = In,
 			.MaxSize = SizeFromNumber(device->Descriptor.MaxPacketSize0),
@@ -151,88 +381,372 @@ s32 BitGetSigned(void* buffer, u32 offset, u32 length) {
 	return result;
 }
 
-Result HidReadDevice(struct UsbDevice *device, u8 reportNumber) {
+/**
+	\brief Appends the extraction steps of a field to its report's plan.
+
+	Emits one step for a variable field, or one per element of an array 
+	field, recording the byte, shift, mask and sign bit needed to decode it
+	from the report buffer, so that HidDecodeReport need not walk the bits 
+	of the report.
+*/
+void HidCompileField(struct HidParserReport *report, struct HidParserField *field) {
+	struct HidExtraction *step;
+	u32 offset, size;
+
+	size = Min(field->Size, 32, u32);
+	for (u32 j = 0; j < (field->Attributes.Variable ? 1 : field->Count); j++) {
+		step = &report->Plan[report->PlanLength++];
+		offset = field->Offset + j * field->Size;
+		step->Byte = offset / 8;
+		step->Shift = offset % 8;
+		if (step->Shift == 0 && size == 8) step->Kind = ExtractByte;
+		else if (step->Shift == 0 && size == 16) step->Kind = ExtractHalf;
+		else if (step->Shift + size <= 32) step->Kind = ExtractWord;
+		else step->Kind = ExtractWide;
+		step->Mask = size == 32 ? 0xffffffff : (1u << size) - 1;
+		step->Sign = field->LogicalMinimum < 0 && size > 0 ? 1u << (size - 1) : 0;
+		step->Value = field->Attributes.Variable ? (void*)&field->Value : (void*)((u32*)field->Value.Pointer + j);
+	}
+}
+
+/**
+	\brief Decodes the values of a report from its buffer.
+
+	Runs the report's extraction plan over ReportBuffer, which must have 
+	HidReportPadding bytes of room past the end of the report for loads.
+*/
+void HidDecodeReport(struct HidParserReport *report) {
+	struct HidExtraction *step;
+	u8 *buffer;
+	u32 value;
+
+	buffer = report->ReportBuffer;
+	for (step = report->Plan; step < report->Plan + report->PlanLength; step++) {
+		switch (step->Kind) {
+		case ExtractByte:
+			value = buffer[step->Byte];
+			break;
+		case ExtractHalf:
+			value = buffer[step->Byte] | (u32)buffer[step->Byte + 1] << 8;
+			break;
+		case ExtractWord:
+			value = (buffer[step->Byte] | (u32)buffer[step->Byte + 1] << 8 | 
+				(u32)buffer[step->Byte + 2] << 16 | (u32)buffer[step->Byte + 3] << 24) >> step->Shift;
+			break;
+		default:
+			value = (buffer[step->Byte] | (u64)buffer[step->Byte + 1] << 8 | 
+				(u64)buffer[step->Byte + 2] << 16 | (u64)buffer[step->Byte + 3] << 24 |
+				(u64)buffer[step->Byte + 4] << 32) >> step->Shift;
+			break;
+		}
+		value &= step->Mask;
+		if (value & step->Sign)
+			value |= ~step->Mask;
+		*step->Value = value;
+	}
+}
+
+/**
+	\brief Decodes a boot keyboard report from its buffer.
+
+	The boot report has a fixed layout, that of hidBootKeyboardDescriptor: 
+	a byte of modifier bits, a reserved byte, and six key codes. Only valid
+	for the input report parsed from that descriptor.
+*/
+void HidDecodeBootKeyboard(struct HidParserReport *report) {
+	struct HidParserField *fields;
+	u32 *keys;
+	u8 *buffer;
+
+	buffer = report->ReportBuffer;
+	fields = report->Fields;
+	for (u32 i = 0; i < 8; i++)
+		fields[i].Value.U32 = (buffer[0] >> i) & 1;
+	keys = (u32*)fields[9].Value.Pointer;
+	for (u32 i = 0; i < 6; i++)
+		keys[i] = buffer[2 + i];
+}
+
+/**
+	\brief Decodes a boot mouse report from its buffer.
+
+	The boot report has a fixed layout, that of hidBootMouseDescriptor: a
+	byte of button bits, then signed X and Y motion. Only valid for the 
+	input report parsed from that descriptor.
+*/
+void HidDecodeBootMouse(struct HidParserReport *report) {
+	struct HidParserField *fields;
+	u8 *buffer;
+
+	buffer = report->ReportBuffer;
+	fields = report->Fields;
+	for (u32 i = 0; i < 3; i++)
+		fields[i].Value.U32 = (buffer[0] >> i) & 1;
+	fields[4].Value.S32 = (s8)buffer[1];
+	fields[5].Value.S32 = (s8)buffer[2];
+}
+
+/**
+	\brief Returns the value of a usage in a field.
+
+	For a variable field this is its value. For an array field, element is 
+	the value an element holds when the usage is active, and this is 1 if 
+	any element holds it and 0 otherwise.
+*/
+s32 HidGetElementValue(struct HidParserField *field, u32 element) {
+	if (field->Attributes.Variable)
+		return field->Value.S32;
+	for (u32 i = 0; i < field->Count; i++)
+		if (HidGetFieldValue(field, i) == (s32)element)
+			return 1;
+	return 0;
+}
+
+/**
+	\brief Calls the subscriptions to a report.
+
+	Called as each input report is drained, after it is decoded and passed 
+	to the bound drivers.
+*/
+void HidNotifySubscriptions(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct HidDevice *data;
+	struct HidSubscription *subscription;
+
+	data = (struct HidDevice*)device->DriverData;
+	for (u32 i = 0; i < HidMaxSubscriptions; i++) {
+		subscription = &data->Subscriptions[i];
+		if (subscription->Report != report)
+			continue;
+		if (subscription->Field == NULL)
+			subscription->ReportCallback(device, report, record, subscription->Context);
+		else
+			subscription->UsageCallback(device, subscription->Usage, 
+				HidGetElementValue(subscription->Field, subscription->Element), record->Time, subscription->Context);
+	}
+}
+
+/**
+	\brief Reads one report from the interrupt IN endpoint.
+
+	Performs a single transfer on the interrupt IN endpoint of the hid 
+	interface into buffer, unless the polling interval of the endpoint has 
+	not elapsed since the last one. Returns ErrorRetry if there is no new
+	report, otherwise the length received is in device->LastTransfer.
+*/
+Result HidReceiveReport(struct UsbDevice *device, u8 *buffer) {
+	struct HidDevice *data;
+	volatile struct UsbEndpointDescriptor *endpoint;
+	Result result;
+	u64 now;
+
+	data = (struct HidDevice*)device->DriverData;
+	endpoint = &device->Endpoints[data->ParserResult->Interface][0];
+	now = MicroTime();
+	if (now < data->NextPoll)
+		return ErrorRetry;
+	data->NextPoll = now + data->PollInterval;
+
+	if ((result = UsbInterruptMessage(
+		device, 
+		(struct UsbPipeAddress) { 
+			.Type = Interrupt, 
+			.Speed = device->Speed, 
+			.EndPoint = endpoint->EndpointAddress.Number, 
+			.Device = device->Number, 
+			.Direction = In,
+			.MaxSize = SizeFromNumber(endpoint->Packet.MaxSize),
+			.PacketSize = endpoint->Packet.MaxSize,
+		},
+		buffer,
+		data->InputSize,
+		NULL,
+		HidMessageTimeout)) != OK) 
+		return result;
+
+	if (device->LastTransfer == 0)
+		return ErrorRetry;
+	return OK;
+}
+
+Result HidPoll(struct UsbDevice *device) {
+	struct HidDevice *data;
+	struct HidReportRecord *record;
+	Result result;
+	u32 head;
+	bool full;
+	
+	data = (struct HidDevice*)device->DriverData;
+	head = data->RingHead;
+	full = head - data->RingTail >= HidReportRingSize;
+	record = &data->Ring[head & (HidReportRingSize - 1)];
+	
+	if ((result = HidReceiveReport(device, full ? data->InputBuffer + HidReportRingSize * data->InputSize : record->Data)) != OK) {
+		if (result != ErrorRetry && result != ErrorDisconnected)
+			LOG_WARNINGF("HID: Could not read %s input report error %d.\n", UsbGetDescription(device), result);
+		return result;
+	}
+	if (full) {
+		data->RingOverflows++;
+		return OK;
+	}
+
+	record->Time = MicroTime();
+	record->Frame = UsbGetFrameNumber();
+	record->Length = device->LastTransfer;
+	MemoryBarrier();
+	data->RingHead = head + 1;
+	return OK;
+}
+
+/**
+	\brief Processes the oldest buffered input report.
+
+	Routes the oldest report in the ring to the parsed input report with the
+	same id, decodes it, passes it to the HidReportReceived handler and then
+	removes it from the ring. Returns the report updated, or NULL if the ring
+	is empty or the report id is unknown. If copy is not NULL, the record is
+	copied to it, and as much of the raw report as fits in the copy->Length 
+	bytes at copy->Data, before it is removed.
+*/
+struct HidParserReport *HidDrainReport(struct UsbDevice *device, struct HidReportRecord *copy) {
 	struct HidDevice *data;
 	struct HidParserResult *parse;
 	struct HidParserReport *report;
-	struct HidParserField *field;
-	Result result;
-	u32 size;
+	struct HidReportRecord *record;
+	u32 tail, size, length;
+	u8 id, *payload;
+	bool changed;
 	
 	data = (struct HidDevice*)device->DriverData;
 	parse = data->ParserResult;
-	report = parse->Report[reportNumber];
-	size = ((report->ReportLength + 7) / 8);
-	if ((report->ReportBuffer == NULL) && (report->ReportBuffer = (u8*)MemoryAllocate(size)) == NULL) {
-		return ErrorMemory;
+	tail = data->RingTail;
+	if (tail == data->RingHead)
+		return NULL;
+	MemoryBarrier();
+	record = &data->Ring[tail & (HidReportRingSize - 1)];
+
+	payload = record->Data;
+	length = record->Length;
+	id = 0;
+	if (data->ReportIds) {
+		id = *payload++;
+		length--;
 	}
-	if ((result = HidGetReport(device, 1, report->Type, report->Id, data->ParserResult->Interface, size, report->ReportBuffer)) != OK) {
-		//if (result != ErrorDisconnected)
-		LOGF("HID: Could not read %s report %d error %d.\n", UsbGetDescription(device), report, result);
-		return 0;
+
+	report = NULL;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		if (parse->Report[i]->Type == Input && parse->Report[i]->Id == id) {
+			report = parse->Report[i];
+			break;
+		}
 	}
-	
-	// Uncomment this for a quick hack to view 8 bytes worth of report.
-	LOGF("HID: %s.Report%d: %02x%02x%02x%02x %02x%02x%02x%02x.\n", UsbGetDescription(device), reportNumber + 1,
-		*(report->ReportBuffer + 0), *(report->ReportBuffer + 1), *(report->ReportBuffer + 2), *(report->ReportBuffer + 3),
-		*(report->ReportBuffer + 4), *(report->ReportBuffer + 5), *(report->ReportBuffer + 6), *(report->ReportBuffer + 7));
 
-	for (u32 i = 0; i < report->FieldCount; i++) {
-		field = &report->Fields[i];
-		if (field->Attributes.Variable) {
-			if (field->LogicalMinimum < 0)
-				field->Value.S32 = BitGetSigned(report->ReportBuffer, field->Offset, field->Size);
-			else
-				field->Value.U32 = BitGetUnsigned(report->ReportBuffer, field->Offset, field->Size);
-		} else {
-			for (u32 j = 0; j < field->Count; j++) {
-				BitSet(
-						field->Value.Pointer,
-						j * field->Size, 
-						field->Size, 
-						field->LogicalMinimum < 0 ? BitGetSigned(
-							report->ReportBuffer, 
-							field->Offset + j * field->Size, 
-							field->Size
-						) : BitGetUnsigned(
-							report->ReportBuffer, 
-							field->Offset + j * field->Size, 
-							field->Size
-						)
-					);				
+	if (report == NULL) 
+		LOG_DEBUGF("HID: %s sent unknown input report %d.\n", UsbGetDescription(device), id);
+	else if (report->ReportBuffer != NULL) {
+		size = ((report->ReportLength + 7) / 8);
+		if (length < size) 
+			MemorySet(report->ReportBuffer + length, 0, size - length);
+		// Copy while comparing, so that an unchanged report, such as one 
+		// repeated by the idle rate, is not decoded again. The fields still 
+		// hold its values from last time.
+		changed = length < size;
+		for (u32 i = 0; i < Min(length, size, u32); i++)
+			if (report->ReportBuffer[i] != payload[i]) {
+				report->ReportBuffer[i] = payload[i];
+				changed = true;
 			}
+		if (changed) {
+			if (data->BootProtocol == 1)
+				HidDecodeBootKeyboard(report);
+			else if (data->BootProtocol == 2)
+				HidDecodeBootMouse(report);
+			else
+				HidDecodeReport(report);
 		}
+		for (u32 i = 0; i < HidMaxBindings; i++)
+			if (data->Bindings[i].HidReportReceived != NULL)
+				data->Bindings[i].HidReportReceived(device, report, record);
+		if (data->SubscriptionCount > 0)
+			HidNotifySubscriptions(device, report, record);
+	}
+	if (copy != NULL) {
+		MemoryCopy(copy->Data, record->Data, Min(record->Length, copy->Length, u32));
+		copy->Time = record->Time;
+		copy->Frame = record->Frame;
+		copy->Length = record->Length;
 	}
 
-	return OK;
+	MemoryBarrier();
+	data->RingTail = tail + 1;
+	return report;
 }
 
-Result HidReadDeviceRaw(struct UsbDevice *device, u8 endPoint, u8 reportNumber, u8* buffer) {
+u32 HidDrainReports(struct UsbDevice *device, u32 count) {
+	struct HidDevice *data;
+	u32 drained;
+
+	data = (struct HidDevice*)device->DriverData;
+	for (drained = 0; drained < count && data->RingTail != data->RingHead; drained++)
+		HidDrainReport(device, NULL);
+	return drained;
+}
+
+Result HidReadDevice(struct UsbDevice *device, u8 reportNumber) {
 	struct HidDevice *data;
 	struct HidParserResult *parse;
 	struct HidParserReport *report;
-	struct HidParserField *field;
 	Result result;
 	u32 size;
+	bool received;
 	
 	data = (struct HidDevice*)device->DriverData;
 	parse = data->ParserResult;
 	report = parse->Report[reportNumber];
+	if (report->Type == Input) {
+		if ((result = HidPoll(device)) != OK && result != ErrorRetry)
+			return result;
+		received = false;
+		while (data->RingTail != data->RingHead) {
+			if (HidDrainReport(device, NULL) == report)
+				received = true;
+		}
+		return received ? OK : ErrorRetry;
+	}
+
 	size = ((report->ReportLength + 7) / 8);
-	if(size < 8)
-		size = 8;
-	if ((result = HidGetReport(device, endPoint, report->Type, report->Id, data->ParserResult->Interface, size, buffer)) != OK) {
-		//if (result != ErrorDisconnected)
-		//LOGF("HID: Could not read %s report %d error %d.\n", UsbGetDescription(device), report, result);
+	if ((result = HidGetReport(device, report->Type, report->Id, parse->Interface, data->ReportIds ? size + 1 : size, report->ReportBuffer)) != OK) {
+		if (result != ErrorDisconnected)
+			LOG_WARNINGF("HID: Could not read %s report %d error %d.\n", UsbGetDescription(device), reportNumber, result);
 		return result;
 	}
+	if (data->ReportIds) {
+		for (u32 i = 0; i < size; i++)
+			report->ReportBuffer[i] = report->ReportBuffer[i + 1];
+	}
+	HidDecodeReport(report);
+
+	return OK;
+}
+
+Result HidReadDeviceRaw(struct UsbDevice *device, u8 reportNumber, u8* buffer, u32 bufferLength) {
+	struct HidDevice *data;
+	struct HidParserReport *report;
+	struct HidReportRecord copy;
+	Result result;
 	
-	// Uncomment this for a quick hack to view 8 bytes worth of report.
-	// LOGF("HID: %s.Report[%d] %d: %02x %02x %02x %02x	%02x %02x %02x %02x.\n", UsbGetDescription(device), reportNumber + 1, size,
-	// 	*(buffer + 0), *(buffer + 1), *(buffer + 2), *(buffer + 3),
-	// 	*(buffer + 4), *(buffer + 5), *(buffer + 6), *(buffer + 7));
+	data = (struct HidDevice*)device->DriverData;
+	report = data->ParserResult->Report[reportNumber];
+	if ((result = HidPoll(device)) != OK && result != ErrorRetry)
+		return result;
 
-	return result;
+	copy.Data = buffer;
+	while (data->RingTail != data->RingHead) {
+		copy.Length = bufferLength;
+		if (HidDrainReport(device, &copy) == report)
+			return OK;
+	}
+	return ErrorRetry;
 }
 
 Result HidWriteDevice(struct UsbDevice *device, u8 reportNumber) {
@@ -247,9 +761,6 @@ Result HidWriteDevice(struct UsbDevice *device, u8 reportNumber) {
 	parse = data->ParserResult;
 	report = parse->Report[reportNumber];
 	size = ((report->ReportLength + 7) / 8);
-	if ((report->ReportBuffer == NULL) && (report->ReportBuffer = (u8*)MemoryAllocate(size)) == NULL) {
-		return ErrorMemory;
-	}
 	for (u32 i = 0; i < report->FieldCount; i++) {
 		field = &report->Fields[i];
 		if (field->Attributes.Variable) {
@@ -265,11 +776,7 @@ Result HidWriteDevice(struct UsbDevice *device, u8 reportNumber) {
 						report->ReportBuffer,
 						field->Offset + j * field->Size, 
 						field->Size,
-						BitGetSigned(
-							field->Value.Pointer, 
-							j * field->Size, 
-							field->Size
-						)
+						((u32*)field->Value.Pointer)[j]
 					);				
 			}
 		}
@@ -277,7 +784,7 @@ Result HidWriteDevice(struct UsbDevice *device, u8 reportNumber) {
 	
 	if ((result = HidSetReport(device, report->Type, report->Id, data->ParserResult->Interface, size, report->ReportBuffer)) != OK) {
 		if (result != ErrorDisconnected)
-			LOGF("HID: Coult not read %s report %d.\n", UsbGetDescription(device), report);
+			LOG_WARNINGF("HID: Coult not read %s report %d.\n", UsbGetDescription(device), report);
 		return result;
 	}
 
@@ -312,6 +819,34 @@ Result HidSetProtocol(struct UsbDevice *device, u8 interface, u16 protocol) {
 	return OK;
 }
 
+Result HidSetIdle(struct UsbDevice *device, u8 interface, u8 reportId, u8 duration) {
+	Result result;
+	
+	if ((result = UsbControlMessage(
+		device, 
+		(struct UsbPipeAddress) { 
+			.Type = Control, 
+			.Speed = device->Speed, 
+			.EndPoint = 0 , 
+			.Device = device->Number, 
+			.Direction = Out,
+			.MaxSize = SizeFromNumber(device->Descriptor.MaxPacketSize0),
+		},
+		NULL,
+		0,
+		&(struct UsbDeviceRequest) {
+			.Request = SetIdle,
+			.Type = 0x21,
+			.Index = interface,
+			.Value = ((u16)duration << 8) | reportId,
+			.Length = 0,
+		},
+		HidMessageTimeout)) != OK) 
+		return result;
+
+	return OK;
+}
+
 void HidEnumerateReport(void* descriptor, u16 length, void(*action)(void* data, u16 tag, u32 value), void* data) {
 	struct HidReportItem *item, *current;
 	u16 parsedLength, currentIndex, currentLength;
@@ -459,98 +994,210 @@ void HidEnumerateActionCountReport(void* data, u16 tag, u32 value) {
 		break;
 	}
 }
-#else
-void HidEnumerateActionCountReport(void* data, u16 tag, u32 value) {
+#endif
+
+/**
+	\brief The sizes of the parts of a parsed report descriptor.
+
+	Gathered by a cheap pre-scan of a report descriptor, which follows only 
+	the items that decide the shape of the reports, so that the whole parse
+	result can be placed in one allocation.
+*/
+struct HidParserSizes {
+	u32 count;
+	u32 size;
+	u8 report;
+	bool overflow;
+	u32 reportCount;
+	u32 fields;
+	u32 values;
+	u32 steps;
+	u32 buffers;
+	s32 logicalMinimum;
+	s32 logicalMaximum;
+	u32 usages;
+	/** Usage ranges of all array fields, and of the current local items. */
+	u32 ranges;
+	u32 localUsages;
 	struct {
-		u8 reportCount;
-		u8 indent;
-		bool input, output, feature;
-	} *reports = data;
+		u8 Id;
+		enum HidReportType Type;
+		u32 Fields;
+		u32 Steps;
+		u32 Bits;
+	} reports[HidMaxReports];
+};
 
-	switch (tag) {
-	case TagMainInput:
-		if (!reports->input) { reports->reportCount++; reports->input = true; }
-		break;
-	case TagMainOutput:
-		if (!reports->output) { reports->reportCount++; reports->output = true; }
-		break;
-	case TagMainFeature:
-		if (!reports->feature) { reports->reportCount++; reports->feature = true; }
-		break;
-	case TagGlobalReportId:
-		reports->input = reports->output = reports->feature = false;
-		break;
-	default:
-		break;
-	}
+/**
+	\brief The state of the parser while adding fields.
+
+	Holds the current global items, and the local usages declared since the
+	last main item, in the order they were declared. Each usage is a range
+	from First to Last, which are equal for a single usage.
+*/
+struct HidParserState {
+	struct HidParserResult *result;
+	u32 *values;
+	struct HidUsageRange *ranges;
+	u32 count;
+	u32 size;
+	s32 logicalMinimum;
+	s32 logicalMaximum;	
+	s32 physicalMinimum;
+	s32 physicalMaximum;
+	struct HidUnit unit;
+	s32 unitExponent;		
+	enum HidUsagePage page;
+	u8 report;
+	struct HidFullUsage physical;
+	struct HidFullUsage application;
+	u32 usageCount;
+	u32 usageIndex;
+	u32 usageOffset;
+	bool usageRange;
+	struct HidUsageRange usages[HidUsageStackSize];
+};
+
+/**
+	\brief The number of usages indexed for an array field.
+
+	One for each logical value from the logical minimum to the logical 
+	maximum, but no more than HidIndexArrayMax.
+*/
+u32 HidIndexArrayLength(s32 minimum, s32 maximum) {
+	if (maximum < minimum) return 0;
+	return Min((u32)(maximum - minimum) + 1, HidIndexArrayMax, u32);
 }
-#endif
 
-void HidEnumerateActionCountField(void* data, u16 tag, u32 value) {
-	struct reportFields_t {
-		u32 count;
-		u8 current;
-		u8 report;
-		struct reportFields_inner_t {
-			u8 reportId;
-			u8 fieldCount;
-			enum HidReportType type;
-		} reports[];
-	} *reportFields = data;
-	struct reportFields_inner_t *inner;
+void HidEnumerateActionSize(void* data, u16 tag, u32 value) {
+	struct HidParserSizes *sizes = data;
 	enum HidReportType type;
+	u32 i, fields, steps;
 	
 	type = 0;
 	switch (tag) {
 	case TagMainFeature: type++;
 	case TagMainOutput: type++;
 	case TagMainInput: type++;
-		inner = NULL;
-		for (u32 i = 0; i < reportFields->current; i++) {
-			if (reportFields->reports[i].reportId == reportFields->report &&
-				reportFields->reports[i].type == type) {
-				inner = &reportFields->reports[i];
+		for (i = 0; i < sizes->reportCount; i++) {
+			if (sizes->reports[i].Id == sizes->report &&
+				sizes->reports[i].Type == type)
 				break; 
+		}
+		if (i == sizes->reportCount) {
+			if (i == HidMaxReports) {
+				sizes->overflow = true;
+				break;
 			}
+			sizes->reports[i].Id = sizes->report;
+			sizes->reports[i].Type = type;
+			sizes->reportCount++;
 		}
-		if (inner == NULL) {
-			inner = &reportFields->reports[reportFields->current++];
-			inner->reportId = reportFields->report;
-			inner->fieldCount = 0;
-			inner->type = type;
+		if (((struct HidMainItem*)&value)->Variable) {
+			fields = steps = sizes->count;
+			sizes->usages += sizes->count;
+		} else {
+			fields = 1;
+			steps = sizes->count;
+			sizes->values += sizes->count;
+			sizes->usages += HidIndexArrayLength(sizes->logicalMinimum, sizes->logicalMaximum);
+			sizes->ranges += sizes->localUsages;
 		}
-		if (((struct HidMainItem*)&value)->Variable) inner->fieldCount += reportFields->count;
-		else inner->fieldCount++;
+		sizes->localUsages = 0;
+		sizes->reports[i].Fields += fields;
+		sizes->reports[i].Steps += steps;
+		sizes->reports[i].Bits += sizes->count * sizes->size;
+		sizes->fields += fields;
+		sizes->steps += steps;
+		if (sizes->reports[i].Fields > 0xffff || sizes->count > 0xffff ||
+			sizes->size > 0xff || sizes->reports[i].Bits > 0xffff)
+			sizes->overflow = true;
 		break;
 	case TagGlobalReportCount:
-		reportFields->count = value;
+		sizes->count = value;
+		break;
+	case TagGlobalReportSize:
+		sizes->size = value;
+		break;
+	case TagGlobalLogicalMinimum:
+		sizes->logicalMinimum = value;
+		break;
+	case TagGlobalLogicalMaximum:
+		sizes->logicalMaximum = value;
 		break;
 	case TagGlobalReportId:
-		reportFields->report = value;
+		sizes->report = value;
+		break;
+	case TagMainCollection:
+		sizes->localUsages = 0;
+		break;
+	case TagLocalUsage:
+	case TagLocalUsageMinimum:
+	case TagLocalUsageMaximum:
+		// At most one range each, as counted by HidAddUsage.
+		if (sizes->localUsages < HidUsageStackSize)
+			sizes->localUsages++;
 		break;
 	default: break;
 	}
 }
 
+/**
+	\brief Takes the next usage for a field.
+
+	Returns the usages declared since the last main item one at a time, in
+	order, stepping through ranges. Once all are used, the last is repeated,
+	and if there are none, the usage is 0.
+*/
+struct HidFullUsage HidNextUsage(struct HidParserState *state) {
+	struct HidFullUsage usage;
+
+	if (state->usageCount == 0) {
+		*(u32*)&usage = 0;
+		return usage;
+	}
+
+	usage = state->usages[state->usageIndex].First;
+	usage.Desktop = (u16)usage.Desktop + state->usageOffset;
+	if ((u16)usage.Desktop < state->usages[state->usageIndex].Last)
+		state->usageOffset++;
+	else if (state->usageIndex + 1 < state->usageCount) {
+		state->usageIndex++;
+		state->usageOffset = 0;
+	}
+	return usage;
+}
+
+/**
+	\brief Records a local usage item.
+
+	Adds a usage, or the start of a usage range, to the local usages. 
+	Values with a high word hold their own usage page.
+*/
+void HidAddUsage(struct HidParserState *state, u32 value, bool range) {
+	struct HidFullUsage usage;
+
+	if (value & 0xffff0000)
+		*(u32*)&usage = value;
+	else {
+		usage.Desktop = (enum HidUsagePageDesktop)value;
+		usage.Page = state->page;
+	}
+	if (state->usageCount == HidUsageStackSize)
+		state->usageCount--;
+	state->usages[state->usageCount].First = usage;
+	state->usages[state->usageCount].Last = (u16)usage.Desktop;
+	state->usageCount++;
+	state->usageRange = range;
+}
+
 void HidEnumerateActionAddField(void* data, u16 tag, u32 value) {
-	struct fields_t {
-		struct HidParserResult *result;
-		u32 count;
-		u32 size;
-		struct HidFullUsage *usage;
-		struct HidFullUsage physical;
-		s32 logicalMinimum;
-		s32 logicalMaximum;	
-		s32 physicalMinimum;
-		s32 physicalMaximum;
-		struct HidUnit unit;
-		s32 unitExponent;		
-		enum HidUsagePage page;
-		u8 report;
-	} *fields = data;
-	enum HidReportType type;
+	struct HidParserState *state = data;
 	struct HidParserReport *report;
-	u32 i;
+	struct HidParserField *field;
+	struct HidFullUsage usage;
+	enum HidReportType type;
+	u32 i, fields;
 
 	type = 0;
 	switch (tag) {
@@ -558,243 +1205,408 @@ void HidEnumerateActionAddField(void* data, u16 tag, u32 value) {
 	case TagMainOutput: type++;
 	case TagMainInput: type++;
 		report = NULL;
-		for (i = 0; i < fields->result->ReportCount; i++)
-			if (fields->result->Report[i]->Id == fields->report &&
-				fields->result->Report[i]->Type == type) {
-				report = fields->result->Report[i];
+		for (i = 0; i < state->result->ReportCount; i++)
+			if (state->result->Report[i]->Id == state->report &&
+				state->result->Report[i]->Type == type) {
+				report = state->result->Report[i];
 				break; 
 			}
-		while (fields->count > 0) {
-			report->FieldCount >= 16;
-				break;
-			if (*(u32*)fields->usage == 0xffffffff) fields->usage++;
-			*(u32*)&(report->Fields[report->FieldCount].Attributes) = value;
-			report->Fields[report->FieldCount].Count = report->Fields[report->FieldCount].Attributes.Variable ? 1 : fields->count;
-			report->Fields[report->FieldCount].LogicalMaximum = fields->logicalMaximum;
-			report->Fields[report->FieldCount].LogicalMinimum = fields->logicalMinimum;
-			report->Fields[report->FieldCount].Offset = report->ReportLength;
-			report->Fields[report->FieldCount].PhysicalMaximum = fields->physicalMaximum;
-			report->Fields[report->FieldCount].PhysicalMinimum = fields->physicalMinimum;
-			*(u32*)&report->Fields[report->FieldCount].PhysicalUsage = *(u32*)&fields->physical;
-			report->Fields[report->FieldCount].Size = fields->size;
-			*(u32*)&report->Fields[report->FieldCount].Unit = *(u32*)&fields->unit;
-			report->Fields[report->FieldCount].UnitExponent = fields->unitExponent;
-			if ((u16)fields->usage->Page == 0xffff) {
-				*(u32*)&report->Fields[report->FieldCount].Usage = *(u32*)&fields->usage[-1];
-				if (fields->usage->Desktop == fields->usage[-1].Desktop ||
-					!report->Fields[report->FieldCount].Attributes.Variable)
-					fields->usage -= 2;
-				else
-					fields->usage[-1].Desktop++;
-			} else {
-				*(u32*)&report->Fields[report->FieldCount].Usage = *(u32*)(fields->usage--);
-			}
-			if (report->Fields[report->FieldCount].Attributes.Variable) {
-				fields->count--;
-				report->ReportLength += report->Fields[report->FieldCount].Size;
-				report->Fields[report->FieldCount].Value.U32 = 0;
-			}
-			else {
-				fields->count = 0;
-				report->ReportLength += report->Fields[report->FieldCount].Size * report->Fields[report->FieldCount].Count;
-				report->Fields[report->FieldCount].Value.Pointer = MemoryAllocate(report->Fields[report->FieldCount].Size * report->Fields[report->FieldCount].Count / 8);
+		if (report == NULL)
+			break;
+
+		if (report->FieldCount == 0)
+			report->Application = state->application;
+		fields = ((struct HidMainItem*)&value)->Variable ? state->count : 1;
+		for (i = 0; i < fields; i++) {
+			field = &report->Fields[report->FieldCount++];
+			*(u32*)&field->Attributes = value;
+			field->Count = field->Attributes.Variable ? 1 : state->count;
+			field->LogicalMaximum = state->logicalMaximum;
+			field->LogicalMinimum = state->logicalMinimum;
+			field->Offset = report->ReportLength;
+			field->PhysicalMaximum = state->physicalMaximum;
+			field->PhysicalMinimum = state->physicalMinimum;
+			field->PhysicalUsage = state->physical;
+			field->Size = state->size;
+			field->Unit = state->unit;
+			field->UnitExponent = state->unitExponent;
+			field->Usage = HidNextUsage(state);
+			if (!field->Attributes.Variable) {
+				field->Value.Pointer = state->values;
+				state->values += field->Count;
+				field->UsageRanges = state->ranges;
+				field->UsageRangeCount = state->usageCount;
+				MemoryCopy(state->ranges, state->usages, sizeof(struct HidUsageRange) * state->usageCount);
+				state->ranges += state->usageCount;
 			}
-			report->FieldCount++;
+			report->ReportLength += field->Size * field->Count;
+			HidCompileField(report, field);
 		}
-		*(u32*)&fields->usage[1] = 0;
+		state->usageCount = state->usageIndex = state->usageOffset = 0;
 		break;
 	case TagMainCollection:
-		if (*(u32*)fields->usage == 0xffffffff) fields->usage++;
+		usage = HidNextUsage(state);
 		switch ((enum HidMainCollection)value) {
-		case Application:			
+		case Application:
+			state->application = usage;
 			/* FIXME:
 			*  only support generic desktop & Digitlizer
 			*/
-			if(((struct HidFullUsage*)fields->usage)->Page == GenericDesktopControl ||
-				((struct HidFullUsage*)fields->usage)->Page == Digitlizer ||
-				((struct HidFullUsage*)fields->usage)->Page == Consumer){
-				*(u32*)&fields->result->Application = *(u32*)fields->usage;
+			if(usage.Page == GenericDesktopControl ||
+				usage.Page == Digitlizer ||
+				usage.Page == Consumer){
+				state->result->Application = usage;
 			}
 			break;
 		case Physical:
-			*(u32*)&fields->physical = *(u32*)fields->usage;
+			state->physical = usage;
 			break;
 		default:
 			break;
 		}
-		fields->usage--;
+		state->usageCount = state->usageIndex = state->usageOffset = 0;
 		break;
 	case TagMainEndCollection:
 		switch ((enum HidMainCollection)value) {
 		case Physical:
-			*(u32*)&fields->physical = 0;
+			*(u32*)&state->physical = 0;
 			break;
 		default:
 			break;
 		}
 		break;
 	case TagGlobalUsagePage:		
-		fields->page = (enum HidUsagePage)value;
+		state->page = (enum HidUsagePage)value;
 		break;
 	case TagGlobalLogicalMinimum:
-		fields->logicalMinimum = value;
+		state->logicalMinimum = value;
 		break;
 	case TagGlobalLogicalMaximum:
-		fields->logicalMaximum = value;
+		state->logicalMaximum = value;
 		break;
 	case TagGlobalPhysicalMinimum:
-		fields->physicalMinimum = value;
+		state->physicalMinimum = value;
 		break;
 	case TagGlobalPhysicalMaximum:
-		fields->physicalMaximum = value;
+		state->physicalMaximum = value;
 		break;
 	case TagGlobalUnitExponent:
-		fields->unitExponent = value;
+		state->unitExponent = value;
 		break;
 	case TagGlobalUnit:
-		*(u32*)&fields->unit = value;
+		*(u32*)&state->unit = value;
 		break;
 	case TagGlobalReportSize:
-		fields->size = value;
+		state->size = value;
 		break;
 	case TagGlobalReportId:
-		fields->report = (u8)value;
+		state->report = (u8)value;
 		break;
 	case TagGlobalReportCount:
-		fields->count = value;
+		state->count = value;
 		break;
 	case TagLocalUsage:
-		fields->usage++;
-		if (value & 0xffff0000)
-			*(u32*)&fields->usage = value;
-		else {
-			fields->usage->Desktop = (enum HidUsagePageDesktop)value;
-			fields->usage->Page = fields->page;
-		}
+		HidAddUsage(state, value, false);
 		break;
 	case TagLocalUsageMinimum:
-		fields->usage++;
-		if (value & 0xffff0000)
-			*(u32*)&fields->usage = value;
-		else {
-			fields->usage->Desktop = (enum HidUsagePageDesktop)value;
-			fields->usage->Page = fields->page;
-		}
+		HidAddUsage(state, value, true);
 		break;
 	case TagLocalUsageMaximum:
-		fields->usage++;
-		fields->usage->Desktop = (enum HidUsagePageDesktop)value;
-		fields->usage->Page = (enum HidUsagePage)0xffff;
+		if (state->usageRange && state->usageCount > 0)
+			state->usages[state->usageCount - 1].Last = (u16)value;
+		else
+			HidAddUsage(state, value, false);
+		state->usageRange = false;
 		break;
 	default: break;
 	}
 }
 
+/**
+	\brief Hashes a usage for the usage index.
+
+	Spreads the page and usage over the low bits, which pick the entry.
+*/
+u32 HidIndexHash(u32 key) {
+	key *= 2654435761u;
+	return key ^ (key >> 16);
+}
+
+/**
+	\brief Adds a usage to the usage index.
+
+	Records that usage is in the given field and element, unless it is 0 or
+	already in the index.
+*/
+void HidIndexAdd(struct HidParserResult *parse, struct HidFullUsage usage, u8 report, u16 field, u16 element) {
+	struct HidUsageIndexEntry *entry;
+	u32 slot;
+
+	if (HidUsageKey(usage) == 0 || parse->IndexSize == 0)
+		return;
+	slot = HidIndexHash(HidUsageKey(usage)) & (parse->IndexSize - 1);
+	for (u32 n = 0; n < parse->IndexSize; n++, slot = (slot + 1) & (parse->IndexSize - 1)) {
+		entry = &parse->Index[slot];
+		if (HidUsageKey(entry->Usage) == HidUsageKey(usage))
+			return;
+		if (HidUsageKey(entry->Usage) == 0) {
+			entry->Usage = usage;
+			entry->Report = report;
+			entry->Field = field;
+			entry->Element = element;
+			return;
+		}
+	}
+}
+
+/**
+	\brief Builds the usage index of a parse result.
+
+	Adds the usages of the fields of the input, then output, then feature 
+	reports, so the first field with a usage is the one found. Constant 
+	fields are left out. Each element value of an array field is a usage.
+*/
+void HidBuildIndex(struct HidParserResult *parse) {
+	struct HidParserReport *report;
+	struct HidParserField *field;
+	struct HidFullUsage usage;
+	u32 length;
+	s32 value;
+
+	for (enum HidReportType type = Input; type <= Feature; type++) {
+		for (u32 i = 0; i < parse->ReportCount; i++) {
+			report = parse->Report[i];
+			if (report->Type != type)
+				continue;
+			for (u32 j = 0; j < report->FieldCount; j++) {
+				field = &report->Fields[j];
+				if (field->Attributes.Constant)
+					continue;
+				if (field->Attributes.Variable) {
+					HidIndexAdd(parse, field->Usage, i, j, 0);
+					continue;
+				}
+				length = HidIndexArrayLength(field->LogicalMinimum, field->LogicalMaximum);
+				for (u32 k = 0; k < length; k++) {
+					value = field->LogicalMinimum + k;
+					// Element only holds the values of ordinary arrays.
+					if (value < 0 || value > 0xffff)
+						continue;
+					usage = HidGetArrayUsage(field, value);
+					HidIndexAdd(parse, usage, i, j, value);
+				}
+			}
+		}
+	}
+}
+
+/**
+	\brief Hashes a raw report descriptor.
+
+	Returns the 32 bit FNV-1a hash of the descriptor bytes.
+*/
+u32 HidHashDescriptor(void* descriptor, u16 length) {
+	u32 hash;
+
+	hash = 2166136261u;
+	for (u32 i = 0; i < length; i++)
+		hash = (hash ^ ((u8*)descriptor)[i]) * 16777619u;
+	return hash;
+}
+
+/**
+	\brief Points a copy of a parse result arena at itself.
+
+	Adjusts every pointer inside parse, a byte for byte copy of the arena 
+	from, to point to the same place in parse instead.
+*/
+void HidRelocateParse(struct HidParserResult *parse, struct HidParserResult *from) {
+	struct HidParserReport *report;
+	s32 delta;
+
+	delta = (u8*)parse - (u8*)from;
+	parse->Index = HidArenaRelocate(parse->Index, delta);
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		report = parse->Report[i] = HidArenaRelocate(parse->Report[i], delta);
+		report->Fields = HidArenaRelocate(report->Fields, delta);
+		report->Plan = HidArenaRelocate(report->Plan, delta);
+		report->ReportBuffer = HidArenaRelocate(report->ReportBuffer, delta);
+		for (u32 j = 0; j < report->FieldCount; j++)
+			if (!report->Fields[j].Attributes.Variable) {
+				report->Fields[j].Value.Pointer = HidArenaRelocate(report->Fields[j].Value.Pointer, delta);
+				report->Fields[j].UsageRanges = HidArenaRelocate(report->Fields[j].UsageRanges, delta);
+			}
+		for (u32 j = 0; j < report->PlanLength; j++)
+			report->Plan[j].Value = HidArenaRelocate(report->Plan[j].Value, delta);
+	}
+}
+
+/**
+	\brief Looks up a report descriptor in the parse cache.
+
+	Returns the entry for this descriptor from a device of the same model, 
+	or NULL if there is none. The hash is only a filter; the descriptor 
+	bytes are compared too.
+*/
+struct HidParseCacheEntry *HidParseCacheFind(u16 vendorId, u16 productId, u32 hash, void* descriptor, u16 length) {
+	struct HidParseCacheEntry *entry;
+	u8 *cached;
+	u32 i;
+
+	for (u32 e = 0; e < HidParseCacheSize; e++) {
+		entry = &hidParseCache[e];
+		if (entry->Template == NULL || entry->Hash != hash || entry->Length != length ||
+			entry->VendorId != vendorId || entry->ProductId != productId)
+			continue;
+		cached = (u8*)entry->Template + entry->Size;
+		for (i = 0; i < length; i++)
+			if (cached[i] != ((u8*)descriptor)[i])
+				break;
+		if (i == length) {
+			entry->LastUsed = ++hidParseCacheClock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+	\brief Adds a freshly parsed report descriptor to the parse cache.
+
+	Copies parse, which must not yet have been used, and the raw descriptor
+	into the least recently used entry. Failure to allocate is ignored, 
+	since the cache is only an optimisation.
+*/
+void HidParseCacheInsert(u16 vendorId, u16 productId, u32 hash, void* descriptor, u16 length, struct HidParserResult *parse, u32 size) {
+	struct HidParseCacheEntry *entry;
+	struct HidParserResult *cached;
+
+	if ((cached = MemoryAllocate(size + length)) == NULL)
+		return;
+	MemoryCopy(cached, parse, size);
+	HidRelocateParse(cached, parse);
+	MemoryCopy((u8*)cached + size, descriptor, length);
+
+	entry = &hidParseCache[0];
+	for (u32 e = 1; e < HidParseCacheSize; e++) {
+		if (entry->Template == NULL) break;
+		if (hidParseCache[e].Template == NULL || hidParseCache[e].LastUsed < entry->LastUsed)
+			entry = &hidParseCache[e];
+	}
+	if (entry->Template != NULL)
+		MemoryDeallocate(entry->Template);
+
+	entry->Hash = hash;
+	entry->VendorId = vendorId;
+	entry->ProductId = productId;
+	entry->Length = length;
+	entry->Size = size;
+	entry->LastUsed = ++hidParseCacheClock;
+	entry->Template = cached;
+}
+
 Result HidParseReportDescriptor(struct UsbDevice *device, void* descriptor, u16 length) {
-	Result result;
 	struct HidDevice *data;
-	struct HidParserResult *parse = NULL;
+	struct HidParserResult *parse;
+	struct HidParserReport *report;
+	struct HidParseCacheEntry *entry;
+	struct HidParserSizes sizes;
+	struct HidParserState state;
+	u8 *arena;
+	u32 size, hash, slots;
+	u16 vendorId, productId;
+#if DEBUG
 	struct {
 		u8 reportCount;
 		u8 indent;
 		bool input, output, feature;
 	} reports = { .reportCount = 0, .indent = 0, .input = false, .output = false, .feature = false };
-	struct reportFields_t {
-		u32 count;
-		u8 current;
-		u8 report;
-		struct reportFields_inner_t {
-			u8 reportId;
-			u8 fieldCount;
-			enum HidReportType type;
-		} reports[];
-	} *reportFields = NULL;
-	struct fields_t {
-		struct HidParserResult *result;
-		u32 count;
-		u32 size;
-		struct HidFullUsage *usage;
-		struct HidFullUsage physical;
-		s32 logicalMinimum;
-		s32 logicalMaximum;	
-		s32 physicalMinimum;
-		s32 physicalMaximum;
-		struct HidUnit unit;
-		s32 unitExponent;		
-		enum HidUsagePage page;
-		u8 report;
-	} *fields = NULL;
-	void* usageStack = NULL;
-
-	data = (struct HidDevice*)device->DriverData;
 
 	HidEnumerateReport(descriptor, length, HidEnumerateActionCountReport, &reports);
-	LOG_DEBUGF("HID: Found %d reports.\n", reports.reportCount);
+#endif
 
-	if ((parse = MemoryAllocate(sizeof(struct HidParserResult) + 4 * reports.reportCount)) == NULL) {
-		result = ErrorMemory;
-		goto deallocate;
+	data = (struct HidDevice*)device->DriverData;
+
+	// The boot descriptors are the same for every model of device.
+	vendorId = productId = 0;
+	if (descriptor != hidBootKeyboardDescriptor && descriptor != hidBootMouseDescriptor) {
+		vendorId = device->Descriptor.VendorId;
+		productId = device->Descriptor.ProductId;
 	}
-	for (u32 i = 0; i < reports.reportCount; i++) {
-		parse->Report[i] = NULL;
+	hash = HidHashDescriptor(descriptor, length);
+	if ((entry = HidParseCacheFind(vendorId, productId, hash, descriptor, length)) != NULL) {
+		LOG_DEBUGF("HID: Report descriptor %x already parsed.\n", hash);
+		if ((parse = MemoryAllocate(entry->Size)) == NULL)
+			return ErrorMemory;
+		MemoryCopy(parse, entry->Template, entry->Size);
+		HidRelocateParse(parse, entry->Template);
+		data->ParserResult = parse;
+		return OK;
 	}
-	if ((reportFields = MemoryAllocate(sizeof(struct reportFields_t) + sizeof(struct reportFields_inner_t) * reports.reportCount)) == NULL) {
-		result = ErrorMemory;
-		goto deallocate;
+
+	MemorySet(&sizes, 0, sizeof(sizes));
+	HidEnumerateReport(descriptor, length, HidEnumerateActionSize, &sizes);
+	if (sizes.overflow) {
+		LOGF("HID: Report descriptor has more than %d reports, or a report too large.\n", HidMaxReports);
+		return ErrorIncompatible;
 	}
-	parse->ReportCount = reports.reportCount;
-	reportFields->count = 0;
-	reportFields->current = 0;
-	reportFields->report = 0;
+	LOG_DEBUGF("HID: Found %d reports.\n", sizes.reportCount);
+	for (u32 i = 0; i < sizes.reportCount; i++)
+		sizes.buffers += HidArenaAlign((sizes.reports[i].Bits + 7) / 8 + HidReportPadding);
+	slots = 0;
+	if (sizes.usages > 0)
+		for (slots = 4; slots <= sizes.usages + sizes.usages / 2; slots <<= 1);
 
-	HidEnumerateReport(descriptor, length, HidEnumerateActionCountField, reportFields);
-	for (u32 i = 0; i < reports.reportCount; i++) {
-		if ((parse->Report[i] = MemoryAllocate(sizeof(struct HidParserReport) + sizeof(struct HidParserField) * reportFields->reports[i].fieldCount)) == NULL) {
-			result = ErrorMemory;
-			goto deallocate;
-		}
-		parse->Report[i]->Index = i;
-		parse->Report[i]->FieldCount = 0;
-		parse->Report[i]->Id = reportFields->reports[i].reportId;
-		parse->Report[i]->Type = reportFields->reports[i].type;
-		parse->Report[i]->ReportLength = 0;
-		parse->Report[i]->ReportBuffer = NULL;
-	}	
-	MemoryDeallocate(reportFields);
-	reportFields = NULL;
-
-	if ((fields = MemoryAllocate(sizeof(struct fields_t))) == NULL) {
-		result = ErrorMemory;
-		goto deallocate;
+	size = HidArenaAlign(sizeof(struct HidParserResult) + sizeof(struct HidParserReport*) * sizes.reportCount) +
+		HidArenaAlign(sizeof(struct HidParserReport)) * sizes.reportCount +
+		sizeof(struct HidParserField) * sizes.fields +
+		sizeof(u32) * sizes.values +
+		sizeof(struct HidUsageRange) * sizes.ranges +
+		sizeof(struct HidExtraction) * sizes.steps +
+		sizes.buffers +
+		sizeof(struct HidUsageIndexEntry) * slots;
+	if ((parse = MemoryAllocate(size)) == NULL)
+		return ErrorMemory;
+	// The counters and the empty usage index slots must start at zero, which
+	// not every memory manager guarantees.
+	MemorySet(parse, 0, size);
+
+	arena = (u8*)parse + HidArenaAlign(sizeof(struct HidParserResult) + sizeof(struct HidParserReport*) * sizes.reportCount);
+	parse->ReportCount = sizes.reportCount;
+	for (u32 i = 0; i < sizes.reportCount; i++) {
+		report = parse->Report[i] = (struct HidParserReport*)arena;
+		arena += HidArenaAlign(sizeof(struct HidParserReport));
+		report->Index = i;
+		report->Id = sizes.reports[i].Id;
+		report->Type = sizes.reports[i].Type;
 	}
-	if ((fields->usage = usageStack = MemoryAllocate(16 * sizeof(struct HidFullUsage*))) == NULL) {
-		result = ErrorMemory;
-		goto deallocate;
-	}	
-	fields->count = 0;
-	fields->logicalMaximum = 0;
-	fields->logicalMinimum = 0;
-	fields->physicalMaximum = 0;
-	fields->physicalMinimum = 0;
-	fields->report = 0;
-	fields->size = 0;
-	*(u32*)fields->usage = 0xffffffff;
-	fields->result = parse;
-	HidEnumerateReport(descriptor, length, HidEnumerateActionAddField, fields);
+	for (u32 i = 0; i < sizes.reportCount; i++) {
+		parse->Report[i]->Fields = (struct HidParserField*)arena;
+		arena += sizeof(struct HidParserField) * sizes.reports[i].Fields;
+	}
+	MemorySet(&state, 0, sizeof(state));
+	state.values = (u32*)arena;
+	arena += sizeof(u32) * sizes.values;
+	state.ranges = (struct HidUsageRange*)arena;
+	arena += sizeof(struct HidUsageRange) * sizes.ranges;
+	for (u32 i = 0; i < sizes.reportCount; i++) {
+		parse->Report[i]->Plan = (struct HidExtraction*)arena;
+		arena += sizeof(struct HidExtraction) * sizes.reports[i].Steps;
+	}
+	for (u32 i = 0; i < sizes.reportCount; i++) {
+		parse->Report[i]->ReportBuffer = arena;
+		arena += HidArenaAlign((sizes.reports[i].Bits + 7) / 8 + HidReportPadding);
+	}
+	parse->Index = (struct HidUsageIndexEntry*)arena;
+	parse->IndexSize = slots;
+
+	state.result = parse;
+	HidEnumerateReport(descriptor, length, HidEnumerateActionAddField, &state);
+	HidBuildIndex(parse);
+	HidParseCacheInsert(vendorId, productId, hash, descriptor, length, parse, size);
 	
 	data->ParserResult = parse;
-	parse = NULL;
-	result = OK;
-deallocate:
-	if (usageStack != NULL) MemoryDeallocate(usageStack);
-	if (fields != NULL) MemoryDeallocate(fields);
-	if (reportFields != NULL) MemoryDeallocate(reportFields);
-	if (parse != NULL) {
-		for (u32 i = 0; i < reports.reportCount; i++)
-			if (parse->Report[i] != NULL) MemoryDeallocate(parse->Report[i]);
-		MemoryDeallocate(parse);
-	}
-	return result;
+	return OK;
 }
 
 void HidDetached(struct UsbDevice *device) {
@@ -803,49 +1615,101 @@ void HidDetached(struct UsbDevice *device) {
 	if (device->DriverData != NULL) {
 		data = (struct HidDevice*)device->DriverData;
 
-		if (data->HidDetached != NULL)
-			data->HidDetached(device);
+		for (u32 i = 0; i < HidMaxBindings; i++)
+			if (data->Bindings[i].HidDetached != NULL)
+				data->Bindings[i].HidDetached(device);
 	}
+	for (u32 i = 0; i < HidMaxDevices; i++)
+		if (hidDevices[i] == device)
+			hidDevices[i] = NULL;
 }
 
 void HidDeallocate(struct UsbDevice *device) {
 	struct HidDevice *data;
-	struct HidParserReport *report;
 	
 	if (device->DriverData != NULL) {
 		data = (struct HidDevice*)device->DriverData;
 
-		if (data->HidDeallocate != NULL)
-			data->HidDeallocate(device);
-
-		if (data->ParserResult != NULL) {
-			for (u32 i = 0; i < data->ParserResult->ReportCount; i++) {
-				if (data->ParserResult->Report[i] != NULL) {
-					report = data->ParserResult->Report[i];
-					if (report->ReportBuffer != NULL)
-						MemoryDeallocate(report->ReportBuffer);
-					for (u32 j = 0; j < report->FieldCount; j++) 
-						if (!report->Fields[j].Attributes.Variable)
-							MemoryDeallocate(report->Fields[j].Value.Pointer);
-					MemoryDeallocate(data->ParserResult->Report[i]);
-				}
-			}
-			MemoryDeallocate(data->ParserResult);
+		for (u32 i = 0; i < HidMaxBindings; i++) {
+			if (data->Bindings[i].HidDeallocate != NULL)
+				data->Bindings[i].HidDeallocate(device);
+			MemorySet(&data->Bindings[i], 0, sizeof(struct HidBinding));
 		}
 
+		if (data->ParserResult != NULL)
+			MemoryDeallocate(data->ParserResult);
+		if (data->InputBuffer != NULL)
+			MemoryDeallocate(data->InputBuffer);
+
 		MemoryDeallocate(data);
 	}
+	for (u32 i = 0; i < HidMaxDevices; i++)
+		if (hidDevices[i] == device)
+			hidDevices[i] = NULL;
 	device->DeviceDeallocate = NULL;
 	device->DeviceDetached = NULL;
 }
 
+/**
+	\brief Attaches the registered drivers to a hid interface.
+
+	Offers each distinct application collection of the interface's reports 
+	to the registered drivers matching its usage and the device, in order,
+	until one attaches or one already attached for another collection is 
+	found. A collection no driver wants is left unbound.
+*/
+void HidAttachDrivers(struct UsbDevice *device, u32 interfaceNumber) {
+	Result (*attached[HidMaxBindings])(struct UsbDevice *device, u32 interfaceNumber);
+	struct HidDevice *data;
+	struct HidParserResult *parse;
+	struct HidDriver *driver;
+	u32 application, attachedCount, j, k;
+
+	data = (struct HidDevice*)device->DriverData;
+	parse = data->ParserResult;
+	attachedCount = 0;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		application = HidUsageKey(parse->Report[i]->Application);
+		for (j = 0; j < i; j++)
+			if (HidUsageKey(parse->Report[j]->Application) == application)
+				break;
+		if (j < i || application == 0)
+			continue;
+
+		data->Application = application;
+		for (j = 0; j < hidDriverCount; j++) {
+			driver = &hidDrivers[j];
+			if (driver->Application != application ||
+				(driver->VendorId != 0 && driver->VendorId != device->Descriptor.VendorId) ||
+				(driver->ProductId != 0 && driver->ProductId != device->Descriptor.ProductId))
+				continue;
+			for (k = 0; k < attachedCount; k++)
+				if (attached[k] == driver->Attach)
+					break;
+			if (k < attachedCount)
+				break;
+			if (driver->Attach(device, interfaceNumber) == OK) {
+				if (attachedCount < HidMaxBindings)
+					attached[attachedCount++] = driver->Attach;
+				break;
+			}
+		}
+		if (j == hidDriverCount)
+			LOG_DEBUGF("HID: No driver for collection %x of %s.\n", application, UsbGetDescription(device));
+	}
+	data->Application = 0;
+}
+
 Result HidAttach(struct UsbDevice *device, u32 interfaceNumber) {
 	struct HidDevice *data;
 	struct HidDescriptor *descriptor;
 	struct UsbDescriptorHeader *header;
+	volatile struct UsbEndpointDescriptor *endpoint;
+	struct HidParserReport *report;
 	void* reportDescriptor = NULL;
 	Result result;
 	u32 currentInterface;
+	u8 boot;
 
 	if (device->Interfaces[interfaceNumber].Class != InterfaceClassHid) {
 		return ErrorArgument;
@@ -870,6 +1734,7 @@ Result HidAttach(struct UsbDevice *device, u32 interfaceNumber) {
 		LOG("HID: Cannot start driver on unconfigured device!\n");
 		return ErrorDevice;
 	}
+	boot = 0;
 	if (device->Interfaces[interfaceNumber].SubClass == 1) {
 		if (device->Interfaces[interfaceNumber].Protocol == 1)
 			LOG_DEBUG("HID: Boot keyboard detected.\n");
@@ -877,11 +1742,24 @@ Result HidAttach(struct UsbDevice *device, u32 interfaceNumber) {
 			LOG_DEBUG("HID: Boot mouse detected.\n");
 		else 
 			LOG_DEBUG("HID: Unknown boot device detected.\n");
-		
-		LOG_DEBUG("HID: Reverting from boot to normal HID mode.\n");
-		if ((result = HidSetProtocol(device, interfaceNumber, 1)) != OK) {
-			LOG("HID: Could not revert to report mode from HID mode.\n");
-			return result;
+
+#if HID_BOOT_PROTOCOL
+		if (device->Interfaces[interfaceNumber].Protocol == 1 ||
+			device->Interfaces[interfaceNumber].Protocol == 2)
+			boot = device->Interfaces[interfaceNumber].Protocol;
+#endif
+		if (boot != 0) {
+			LOG_DEBUG("HID: Keeping boot mode.\n");
+			if ((result = HidSetProtocol(device, interfaceNumber, 0)) != OK) {
+				LOG("HID: Could not set boot mode.\n");
+				return result;
+			}
+		} else {
+			LOG_DEBUG("HID: Reverting from boot to normal HID mode.\n");
+			if ((result = HidSetProtocol(device, interfaceNumber, 1)) != OK) {
+				LOG("HID: Could not revert to report mode from HID mode.\n");
+				return result;
+			}
 		}
 	}
 
@@ -925,44 +1803,88 @@ Result HidAttach(struct UsbDevice *device, u32 interfaceNumber) {
 		result = ErrorMemory;
 		goto deallocate;
 	}
+	// Bindings, subscriptions, report ids and the report ring all start 
+	// empty; not every memory manager zeroes allocations.
+	data = (struct HidDevice*)device->DriverData;
+	MemorySet(data, 0, sizeof(struct HidDevice));
 	device->DriverData->DataSize = sizeof(struct HidDevice);
 	device->DriverData->DeviceDriver = DeviceDriverHid;
-	data = (struct HidDevice*)device->DriverData;
 	data->Descriptor = descriptor;
-	data->DriverData = NULL;
+	data->BootProtocol = boot;
 	
-	if ((reportDescriptor = MemoryAllocate(descriptor->OptionalDescriptors[0].Length)) == NULL) {
-		result = ErrorMemory;
-		goto deallocate;
-	}
-	if ((result = UsbGetDescriptor(device, HidReport, 0, interfaceNumber, reportDescriptor, descriptor->OptionalDescriptors[0].Length, descriptor->OptionalDescriptors[0].Length, 1)) != OK) {
+	// Boot devices are read with the boot report descriptors, so theirs is 
+	// never fetched.
+	if (boot != 0) {
+		if (boot == 1)
+			result = HidParseReportDescriptor(device, hidBootKeyboardDescriptor, sizeof(hidBootKeyboardDescriptor));
+		else
+			result = HidParseReportDescriptor(device, hidBootMouseDescriptor, sizeof(hidBootMouseDescriptor));
+		if (result != OK) {
+			LOGF("HID: Could not parse boot report descriptor for %s.Interface%d.\n", UsbGetDescription(device), interfaceNumber + 1);
+			goto deallocate;
+		}
+	} else {
+		if ((reportDescriptor = MemoryAllocate(descriptor->OptionalDescriptors[0].Length)) == NULL) {
+			result = ErrorMemory;
+			goto deallocate;
+		}
+		if ((result = UsbGetDescriptor(device, HidReport, 0, interfaceNumber, reportDescriptor, descriptor->OptionalDescriptors[0].Length, descriptor->OptionalDescriptors[0].Length, 1)) != OK) {
+			MemoryDeallocate(reportDescriptor);
+			LOGF("HID: Could not read report descriptor for %s.Interface%d.\n", UsbGetDescription(device), interfaceNumber + 1);
+			goto deallocate;
+		}
+		if ((result = HidParseReportDescriptor(device, reportDescriptor, descriptor->OptionalDescriptors[0].Length)) != OK) {		
+			MemoryDeallocate(reportDescriptor);
+			LOGF("HID: Invalid report descriptor for %s.Interface%d.\n", UsbGetDescription(device), interfaceNumber + 1);
+			goto deallocate;
+		}
+
 		MemoryDeallocate(reportDescriptor);
-		LOGF("HID: Could not read report descriptor for %s.Interface%d.\n", UsbGetDescription(device), interfaceNumber + 1);
-		goto deallocate;
+		reportDescriptor = NULL;
 	}
-	if ((result = HidParseReportDescriptor(device, reportDescriptor, descriptor->OptionalDescriptors[0].Length)) != OK) {		
-		MemoryDeallocate(reportDescriptor);
-		LOGF("HID: Invalid report descriptor for %s.Interface%d.\n", UsbGetDescription(device), interfaceNumber + 1);
+
+	data->ParserResult->Interface = interfaceNumber;
+	for (u32 i = 0; i < data->ParserResult->ReportCount; i++) {
+		if (data->ParserResult->Report[i]->Id != 0)
+			data->ReportIds = true;
+	}
+	endpoint = &device->Endpoints[interfaceNumber][0];
+	data->InputSize = endpoint->Packet.MaxSize;
+	for (u32 i = 0; i < data->ParserResult->ReportCount; i++) {
+		report = data->ParserResult->Report[i];
+		if (report->Type != Input) continue;
+		data->InputSize = Max(data->InputSize, (report->ReportLength + 7) / 8 + (data->ReportIds ? 1 : 0), u32);
+	}
+	data->InputSize = (data->InputSize + 3) & ~3;
+	if ((data->InputBuffer = MemoryAllocate((HidReportRingSize + 1) * data->InputSize)) == NULL) {
+		result = ErrorMemory;
 		goto deallocate;
 	}
+	for (u32 i = 0; i < HidReportRingSize; i++)
+		data->Ring[i].Data = data->InputBuffer + i * data->InputSize;
+	data->RingHead = data->RingTail = data->RingOverflows = 0;
+	if (device->Speed == High)
+		data->PollInterval = 125 << (Min(Max(endpoint->Interval, 1, u32), 16, u32) - 1);
+	else
+		data->PollInterval = 1000 * Max(endpoint->Interval, 1, u32);
+	data->NextPoll = 0;
 
-	MemoryDeallocate(reportDescriptor);
-	reportDescriptor = NULL;
-
-	data->ParserResult->Interface = interfaceNumber;
-	if (data->ParserResult->Application.Page == GenericDesktopControl &&
-		(u16)data->ParserResult->Application.Desktop < HidUsageAttachCount &&
-		HidUsageAttach[(u16)data->ParserResult->Application.Desktop] != NULL) {
-		HidUsageAttach[(u16)data->ParserResult->Application.Desktop](device, interfaceNumber);
-	}else if((data->ParserResult->Application.Page == Digitlizer) &&
-		(u16)data->ParserResult->Application.Digitlizer < HidUsageAttachCount &&
-		HidUsageAttach[(u16)data->ParserResult->Application.Digitlizer] != NULL){
-		HidUsageAttach[(u16)data->ParserResult->Application.Digitlizer](device, interfaceNumber);
-	}else if((data->ParserResult->Application.Page == Consumer) &&
-		(u16)data->ParserResult->Application.Desktop < HidUsageAttachCount &&
-		HidUsageAttach[(u16)data->ParserResult->Application.Desktop] != NULL){
-		HidUsageAttach[(u16)data->ParserResult->Application.Desktop](device, interfaceNumber);
+	// Keyboards need only report when a key changes. Anything else keeps 
+	// the idle rate the device chose, until its driver asks otherwise.
+	if ((data->ParserResult->Application.Page == GenericDesktopControl &&
+		data->ParserResult->Application.Desktop == DesktopKeyboard) ||
+		(device->Interfaces[interfaceNumber].SubClass == 1 &&
+		device->Interfaces[interfaceNumber].Protocol == 1)) {
+		if ((result = HidSetIdle(device, interfaceNumber, 0, HidIdleInfinite)) != OK)
+			LOG_DEBUGF("HID: %s refused to set idle, error %d.\n", UsbGetDescription(device), result);
 	}
+
+	for (u32 i = 0; i < HidMaxDevices; i++)
+		if (hidDevices[i] == NULL) {
+			hidDevices[i] = device;
+			break;
+		}
+	HidAttachDrivers(device, interfaceNumber);
 	return OK;
 deallocate:
 	if (reportDescriptor != NULL) MemoryDeallocate(reportDescriptor);
@@ -971,5 +1893,58 @@ deallocate:
 }
 
 s32 HidGetFieldValue(struct HidParserField *field, u32 index) {
-	return BitGetSigned(field->Value.Pointer, index * field->Size, field->Size);
+	return ((s32*)field->Value.Pointer)[index];
+}
+
+struct HidFullUsage HidGetArrayUsage(struct HidParserField *field, s32 value) {
+	struct HidFullUsage usage;
+	struct HidUsageRange *range;
+	u32 offset, length;
+
+	*(u32*)&usage = 0;
+	if (value < field->LogicalMinimum || value > field->LogicalMaximum)
+		return usage;
+	offset = (u32)(value - field->LogicalMinimum);
+	for (u32 i = 0; i < field->UsageRangeCount; i++) {
+		range = &field->UsageRanges[i];
+		length = range->Last >= (u16)range->First.Desktop ? range->Last - (u16)range->First.Desktop + 1 : 1;
+		if (offset < length) {
+			usage = range->First;
+			usage.Desktop = (enum HidUsagePageDesktop)((u16)usage.Desktop + offset);
+			return usage;
+		}
+		offset -= length;
+	}
+	return usage;
+}
+
+struct HidParserField *HidFindField(struct HidParserResult *parse, struct HidFullUsage usage, 
+	struct HidParserReport **report, u32 *element) {
+	struct HidUsageIndexEntry *entry;
+	u32 slot;
+
+	if (parse == NULL || parse->IndexSize == 0 || HidUsageKey(usage) == 0)
+		return NULL;
+	slot = HidIndexHash(HidUsageKey(usage)) & (parse->IndexSize - 1);
+	for (u32 n = 0; n < parse->IndexSize; n++, slot = (slot + 1) & (parse->IndexSize - 1)) {
+		entry = &parse->Index[slot];
+		if (HidUsageKey(entry->Usage) == 0)
+			break;
+		if (HidUsageKey(entry->Usage) == HidUsageKey(usage)) {
+			if (report != NULL) *report = parse->Report[entry->Report];
+			if (element != NULL) *element = entry->Element;
+			return &parse->Report[entry->Report]->Fields[entry->Field];
+		}
+	}
+	return NULL;
+}
+
+Result HidGetUsageValue(struct HidParserResult *parse, struct HidFullUsage usage, s32 *value) {
+	struct HidParserField *field;
+	u32 element;
+
+	if ((field = HidFindField(parse, usage, NULL, &element)) == NULL)
+		return ErrorArgument;
+	*value = HidGetElementValue(field, element);
+	return OK;
 }
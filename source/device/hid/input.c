@@ -0,0 +1,127 @@
+/******************************************************************************
+*	device/hid/input.c
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/input.c contains code relating to the input event stream. The
+*	hid drivers publish each change they decode to one queue, so that one
+*	call polls every device, and one reads back what they did. The queue has
+*	one writer, the drivers as reports are drained, and one reader.
+******************************************************************************/
+#define LOG_MODULE_LEVEL HID_LOG_LEVEL
+#include <device/hid/hid.h>
+#include <device/hid/input.h>
+#include <platform/platform.h>
+#include <types.h>
+#include <usbd/device.h>
+#include <usbd/usbd.h>
+
+struct InputEvent inputEvents[InputEventQueueSize];
+/** Count of events added to inputEvents. Only written by InputPublish. */
+volatile u32 inputHead = 0;
+/** Count of events read from inputEvents. Only written by InputReadEvents. */
+volatile u32 inputTail = 0;
+volatile u32 inputOverflows = 0;
+/** Whether an event was added since the last InputEventSync. */
+bool inputUnsynced = false;
+/** Whether events were lost and InputEventDropped is yet to be published. */
+bool inputDropped = false;
+/** Whether the rest of the current report is being discarded. */
+bool inputDiscarding = false;
+
+/**
+	\brief Writes an event into the slot of inputEvents at head.
+*/
+void InputWrite(u32 head, u32 device, enum InputEventType type, u32 code, s32 value, u64 time) {
+	struct InputEvent *event;
+
+	event = &inputEvents[head & (InputEventQueueSize - 1)];
+	event->Time = time;
+	event->Device = device;
+	event->Type = type;
+	event->Code = code;
+	event->Value = value;
+}
+
+void InputPublish(u32 device, enum InputEventType type, u32 code, s32 value, u64 time) {
+	u32 head, needed;
+
+	head = inputHead;
+	if (type == InputEventSync)
+		inputDiscarding = false;
+	else if (inputDiscarding) {
+		// The rest of a report with lost events is lost too, rather than 
+		// publishing part of it.
+		inputOverflows++;
+		return;
+	}
+
+	// Once events are lost, InputEventDropped is owed at the next report
+	// boundary with room: in place of a report's sync, or before the first
+	// event of a report.
+	needed = inputDropped && type != InputEventSync ? 2 : 1;
+	if (head - inputTail > InputEventQueueSize - needed) {
+		if (type != InputEventSync) {
+			inputOverflows++;
+			inputDiscarding = true;
+		}
+		inputDropped = true;
+		return;
+	}
+	if (inputDropped) {
+		inputDropped = false;
+		InputWrite(head++, device, InputEventDropped, 0, 0, time);
+		inputUnsynced = false;
+		if (type == InputEventSync) {
+			MemoryBarrier();
+			inputHead = head;
+			return;
+		}
+	}
+
+	InputWrite(head, device, type, code, value, time);
+	MemoryBarrier();
+	inputHead = head + 1;
+	inputUnsynced = type != InputEventSync;
+}
+
+void InputSync(u32 device, u64 time) {
+	if (inputUnsynced || inputDropped)
+		InputPublish(device, InputEventSync, 0, 0, time);
+}
+
+Result InputPoll() {
+	struct UsbDevice *device;
+	Result result;
+
+	for (u32 i = 0; i < HidMaxDevices; i++) {
+		if ((device = HidGetDevice(i)) == NULL)
+			continue;
+		if ((result = HidPoll(device)) != OK && result != ErrorRetry) {
+			if (result != ErrorDisconnected)
+				LOG_WARNINGF("HID: Could not get report from %s.\n", UsbGetDescription(device));
+			continue;
+		}
+		HidDrainReports(device, HidReportRingSize);
+	}
+	return OK;
+}
+
+u32 InputReadEvents(struct InputEvent *events, u32 count) {
+	u32 head, tail, read;
+
+	tail = inputTail;
+	head = inputHead;
+	MemoryBarrier();
+	for (read = 0; read < count && tail != head; read++, tail++)
+		MemoryCopy(&events[read], &inputEvents[tail & (InputEventQueueSize - 1)], sizeof(struct InputEvent));
+	MemoryBarrier();
+	inputTail = tail;
+	return read;
+}
+
+u32 InputOverflows() {
+	return inputOverflows;
+}
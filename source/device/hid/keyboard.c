@@ -11,6 +11,7 @@
 *	a little awkwardly on purpose to make OS development more fun!
 ******************************************************************************/
 #include <device/hid/hid.h>
+#include <device/hid/input.h>
 #include <device/hid/keyboard.h>
 #include <device/hid/report.h>
 #include <platform/platform.h>
@@ -33,7 +34,7 @@ void KbdLoad()
 		keyboardAddresses[i] = 0;
 		keyboards[i] = NULL;
 	}
-	HidUsageAttach[DesktopKeyboard] = KeyboardAttach;
+	HidRegisterDriver(GenericDesktopControl, DesktopKeyboard, 0, 0, HidPriorityGeneric, KeyboardAttach);
 }
 
 u32 KeyboardIndex(u32 address) {
@@ -61,7 +62,7 @@ u32 KeyboardGetAddress(u32 index) {
 void KeyboardDetached(struct UsbDevice *device) {
 	struct KeyboardDevice *data;
 	
-	data = (struct KeyboardDevice*)((struct HidDevice*)device->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(device, DeviceDriverKeyboard);
 	if (data != NULL) {
 		if (keyboardAddresses[data->Index] == device->Number) {
 			keyboardAddresses[data->Index] = 0;
@@ -74,18 +75,117 @@ void KeyboardDetached(struct UsbDevice *device) {
 void KeyboardDeallocate(struct UsbDevice *device) {
 	struct KeyboardDevice *data;
 	
-	data = (struct KeyboardDevice*)((struct HidDevice*)device->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(device, DeviceDriverKeyboard);
 	if (data != NULL) {
+		HidUnbindDriver(device, DeviceDriverKeyboard);
 		MemoryDeallocate(data);
-		((struct HidDevice*)device->DriverData)->DriverData = NULL;
 	}
-	((struct HidDevice*)device->DriverData)->HidDeallocate = NULL;
-	((struct HidDevice*)device->DriverData)->HidDetached = NULL;
+}
+
+/**
+	\brief Queues a key transition.
+
+	Adds an event to the keyboard's queue, or counts it as lost if the queue
+	is full. Only called when reports are received, so there is only ever one
+	writer.
+*/
+void KeyboardQueueEvent(struct KeyboardDevice *data, u64 time, u16 key, bool down) {
+	struct KeyboardEvent *event;
+	u32 head;
+
+	head = data->EventHead;
+	if (head - data->EventTail >= KeyboardEventQueueSize) {
+		data->EventOverflows++;
+		return;
+	}
+
+	event = &data->Events[head & (KeyboardEventQueueSize - 1)];
+	event->Time = time;
+	event->Key = key;
+	event->Down = down;
+	event->Modifiers = data->Modifiers;
+	MemoryBarrier();
+	data->EventHead = head + 1;
+}
+
+/**
+	\brief Counts the bits set in a word.
+*/
+u32 KeyboardBitCount(u32 word) {
+	word = word - ((word >> 1) & 0x55555555);
+	word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+	return (((word + (word >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+void KeyboardReportReceived(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct KeyboardDevice *data;
+	struct HidParserField *field;
+	struct HidFullUsage usage;
+	u32 keys[KeyboardKeyWords], changed, bit, count;
+	u16 key;
+	u64 time;
+
+	data = (struct KeyboardDevice*)HidGetDriverData(device, DeviceDriverKeyboard);
+	if (data == NULL || report != data->KeyReport)
+		return;
+	time = record != NULL ? record->Time : MicroTime();
+
+	for (u32 i = 0; i < KeyboardKeyWords; i++)
+		keys[i] = 0;
+
+	// One bit fields, from n-key rollover bitmaps and the modifiers.
+	for (u32 i = data->KeyBitsFirst; i < data->KeyBitsEnd; i++) {
+		field = &report->Fields[i];
+		if (field->Attributes.Variable && field->Value.Bool &&
+			(field->Usage.Page == KeyboardControl || field->Usage.Page == Undefined) &&
+			(u16)field->Usage.Keyboard < KeyboardKeyWords * 32) {
+			key = (u16)field->Usage.Keyboard;
+			keys[key / 32] |= 1u << (key % 32);
+		}
+	}
+
+	// The array of keys. If the keyboard has rolled over, only the modifiers
+	// are meaningful, and the other keys stay as they were.
+	if ((field = data->KeyFields[8]) != NULL) {
+		usage = HidGetArrayUsage(field, HidGetFieldValue(field, 0));
+		if (usage.Page == KeyboardControl && usage.Keyboard == KeyboardErrorRollOver) {
+			for (u32 i = 0; i < KeyboardKeyWords; i++)
+				if (i == KeyboardLeftControl / 32)
+					keys[i] |= data->Keys[i] & ~(0xff << (KeyboardLeftControl % 32));
+				else
+					keys[i] |= data->Keys[i];
+		} else {
+			for (u32 i = 0; i < field->Count; i++) {
+				usage = HidGetArrayUsage(field, HidGetFieldValue(field, i));
+				key = (u16)usage.Keyboard;
+				if (usage.Page == KeyboardControl && key > KeyboardErrorUndefined && key < KeyboardKeyWords * 32)
+					keys[key / 32] |= 1u << (key % 32);
+			}
+		}
+	}
+
+	*(u8*)&data->Modifiers = keys[KeyboardLeftControl / 32] >> (KeyboardLeftControl % 32);
+	count = 0;
+	for (u32 i = 0; i < KeyboardKeyWords; i++) {
+		changed = keys[i] ^ data->Keys[i];
+		while (changed != 0) {
+			bit = __builtin_ctz(changed);
+			changed &= changed - 1;
+			KeyboardQueueEvent(data, time, i * 32 + bit, (keys[i] & (1u << bit)) != 0);
+			InputPublish(device->Number, InputEventKey, HidUsage(KeyboardControl, i * 32 + bit), (keys[i] >> bit) & 1, time);
+		}
+		data->Keys[i] = keys[i];
+		count += KeyboardBitCount(keys[i]);
+	}
+	data->KeyCount = count - KeyboardBitCount(*(u8*)&data->Modifiers);
+	InputSync(device->Number, time);
 }
 
 Result KeyboardAttach(struct UsbDevice *device, u32 interface) {
-	u32 keyboardNumber;
+	u32 keyboardNumber, count, best;
+	struct HidParserField *field;
 	struct HidDevice *hidData;
+	struct HidBinding *binding;
 	struct KeyboardDevice *data;
 	struct HidParserResult *parse;
 
@@ -104,24 +204,28 @@ Result KeyboardAttach(struct UsbDevice *device, u32 interface) {
 	}
 
 	parse = hidData->ParserResult;
-	if ((parse->Application.Page != GenericDesktopControl && parse->Application.Page != Undefined) ||
-		parse->Application.Desktop != DesktopKeyboard) {
-		LOGF("KBD: %s doesn't seem to be a keyboard (%x != %x || %x != %x)...\n", UsbGetDescription(device), parse->Application.Page, GenericDesktopControl, parse->Application.Desktop, DesktopKeyboard);
+	if (hidData->Application != HidUsage(GenericDesktopControl, DesktopKeyboard)) {
+		LOGF("KBD: %s doesn't seem to be a keyboard (%x != %x)...\n", UsbGetDescription(device), hidData->Application, HidUsage(GenericDesktopControl, DesktopKeyboard));
 		return ErrorIncompatible;
 	}
 	if (parse->ReportCount < 1) {
 		LOGF("KBD: %s doesn't have enough outputs to be a keyboard.\n", UsbGetDescription(device));
 		return ErrorIncompatible;
 	}
-	hidData->HidDetached = KeyboardDetached;
-	hidData->HidDeallocate = KeyboardDeallocate;
-	if ((hidData->DriverData = MemoryAllocate(sizeof(struct KeyboardDevice))) == NULL) {
+	if ((data = MemoryAllocate(sizeof(struct KeyboardDevice))) == NULL) {
 		LOGF("KBD: Not enough memory to allocate keyboard %s.\n", UsbGetDescription(device));
 		return ErrorMemory;
 	}
-	data = (struct KeyboardDevice*)hidData->DriverData;
 	data->Header.DeviceDriver = DeviceDriverKeyboard;
 	data->Header.DataSize = sizeof(struct KeyboardDevice);
+	if ((binding = HidBindDriver(device, (struct UsbDriverDataHeader*)data)) == NULL) {
+		LOGF("KBD: %s not connected. Too many drivers bound to it.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+	binding->HidDetached = KeyboardDetached;
+	binding->HidDeallocate = KeyboardDeallocate;
+	binding->HidReportReceived = KeyboardReportReceived;
 	data->Index = keyboardNumber = 0xffffffff;
 	for (u32 i = 0; i < KeyboardMaxKeyboards; i++) {
 		if (keyboardAddresses[i] == 0) {
@@ -139,10 +243,12 @@ Result KeyboardAttach(struct UsbDevice *device, u32 interface) {
 	}
 
 	keyboards[keyboardNumber] = device;
-	for (u32 i = 0; i < KeyboardMaxKeys; i++)
+	for (u32 i = 0; i < KeyboardKeyWords; i++)
 		data->Keys[i] = 0;
 	*(u8*)&data->Modifiers = 0;
 	*(u8*)&data->LedSupport = 0;
+	data->KeyCount = 0;
+	data->EventHead = data->EventTail = data->EventOverflows = 0;
 
 	for (u32 i = 0; i < 9; i++)
 		data->KeyFields[i] = NULL;
@@ -150,31 +256,52 @@ Result KeyboardAttach(struct UsbDevice *device, u32 interface) {
 		data->LedFields[i] = NULL;
 	data->LedReport = NULL;
 	data->KeyReport = NULL;
+	data->KeyBitsFirst = data->KeyBitsEnd = 0;
 
+	// Use the input report which can hold the most keys, so that n-key 
+	// rollover reports are preferred to boot style ones.
+	best = 0;
 	for (u32 i = 0; i < parse->ReportCount; i++) {
-    LOG_DEBUGF("KBD: type %x report %d. %d fields.\n", parse->Report[i]->Type, i, parse->Report[i]->FieldCount);
-		if (parse->Report[i]->Type == Input && 
-			data->KeyReport == NULL) {
-			LOG_DEBUGF("KBD: Output report %d. %d fields.\n", i, parse->Report[i]->FieldCount);
+		if (parse->Report[i]->Type != Input) continue;
+		count = 0;
+		for (u32 j = 0; j < parse->Report[i]->FieldCount; j++) {
+			field = &parse->Report[i]->Fields[j];
+			if (field->Usage.Page == KeyboardControl || field->Usage.Page == Undefined)
+				count += field->Count;
+		}
+		if (count > best) {
+			best = count;
 			data->KeyReport = parse->Report[i];
-			for (u32 j = 0; j < parse->Report[i]->FieldCount; j++) {
-				if (parse->Report[i]->Fields[j].Usage.Page == KeyboardControl || parse->Report[i]->Fields[j].Usage.Page == Undefined) {
-					if (parse->Report[i]->Fields[j].Attributes.Variable) {
-						if (parse->Report[i]->Fields[j].Usage.Keyboard >= KeyboardLeftControl
-							&& parse->Report[i]->Fields[j].Usage.Keyboard <= KeyboardRightGui)
-							LOG_DEBUGF("KBD: Modifier %d detected! Offset=%x, size=%x\n", parse->Report[i]->Fields[j].Usage.Keyboard, parse->Report[i]->Fields[j].Offset, parse->Report[i]->Fields[j].Size);
-							data->KeyFields[(u16)parse->Report[i]->Fields[j].Usage.Keyboard - (u16)KeyboardLeftControl] = 
-								&parse->Report[i]->Fields[j];
-					} else {
-						LOG_DEBUG("KBD: Key input detected!\n");
-						data->KeyFields[8] = &parse->Report[i]->Fields[j];
-					}
+		}
+	}
+
+	if (data->KeyReport != NULL) {
+		LOG_DEBUGF("KBD: Input report %d. %d fields.\n", data->KeyReport->Index, data->KeyReport->FieldCount);
+		for (u32 j = 0; j < data->KeyReport->FieldCount; j++) {
+			field = &data->KeyReport->Fields[j];
+			if (field->Usage.Page != KeyboardControl && field->Usage.Page != Undefined)
+				continue;
+			if (field->Attributes.Variable) {
+				if (field->Usage.Keyboard >= KeyboardLeftControl
+					&& field->Usage.Keyboard <= KeyboardRightGui) {
+					LOG_DEBUGF("KBD: Modifier %d detected! Offset=%x, size=%x\n", field->Usage.Keyboard, field->Offset, field->Size);
+					data->KeyFields[(u16)field->Usage.Keyboard - (u16)KeyboardLeftControl] = field;
 				}
+				if (data->KeyBitsEnd == 0)
+					data->KeyBitsFirst = j;
+				data->KeyBitsEnd = j + 1;
+			} else {
+				LOG_DEBUG("KBD: Key input detected!\n");
+				data->KeyFields[8] = field;
 			}
-		} else if (parse->Report[i]->Type == Output && 
+		}
+	}
+
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		if (parse->Report[i]->Type == Output && 
 			data->LedReport == NULL) {
 			data->LedReport = parse->Report[i];
-			LOG_DEBUGF("KBD: Input report %d. %d fields.\n", i, parse->Report[i]->FieldCount);
+			LOG_DEBUGF("KBD: Output report %d. %d fields.\n", i, parse->Report[i]->FieldCount);
 			for (u32 j = 0; j < parse->Report[i]->FieldCount; j++) {
 				if (parse->Report[i]->Fields[j].Usage.Page == Led) {
 					switch (parse->Report[i]->Fields[j].Usage.Led) {
@@ -240,7 +367,7 @@ Result KeyboardSetLeds(u32 keyboardAddress, struct KeyboardLeds leds) {
 
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return ErrorDisconnected;
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 
 	if (data->LedSupport.NumberLock)
 		data->LedFields[0]->Value.Bool = leds.NumberLock;
@@ -268,7 +395,7 @@ struct KeyboardLeds KeyboardGetLedSupport(u32 keyboardAddress) {
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return (struct KeyboardLeds) { };
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 	return data->LedSupport;
 }
 
@@ -279,48 +406,42 @@ Result KeyboardPoll(u32 keyboardAddress) {
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);	
 	if (keyboardNumber == 0xffffffff) return ErrorDisconnected;
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 	if ((result = HidReadDevice(keyboards[keyboardNumber], data->KeyReport->Index)) != OK) {
-		if (result != ErrorDisconnected)
+		if (result == ErrorRetry)
+			return OK;
 		return result;
 	}
 
-	if (data->KeyFields[0] != NULL)
-		data->Modifiers.LeftControl = data->KeyFields[0]->Value.Bool;
-	if (data->KeyFields[1] != NULL)
-		data->Modifiers.LeftShift = data->KeyFields[1]->Value.Bool;
-	if (data->KeyFields[2] != NULL)
-		data->Modifiers.LeftAlt = data->KeyFields[2]->Value.Bool;
-	if (data->KeyFields[3] != NULL)
-		data->Modifiers.LeftGui = data->KeyFields[3]->Value.Bool;
-	if (data->KeyFields[4] != NULL)
-		data->Modifiers.RightControl = data->KeyFields[4]->Value.Bool;
-	if (data->KeyFields[5] != NULL)
-		data->Modifiers.RightShift = data->KeyFields[5]->Value.Bool;
-	if (data->KeyFields[6] != NULL)
-		data->Modifiers.RightAlt = data->KeyFields[6]->Value.Bool;
-	if (data->KeyFields[7] != NULL)
-		data->Modifiers.RightGui = data->KeyFields[7]->Value.Bool;
-	if (data->KeyFields[8] != NULL) {
-		if (HidGetFieldValue(data->KeyFields[8], 0) != KeyboardErrorRollOver) {
-			data->KeyCount = 0;
-			for (u32 i = 0; i < KeyboardMaxKeys && i < data->KeyFields[8]->Count; i++) {
-				if ((data->Keys[i] = HidGetFieldValue(data->KeyFields[8], i)) + (u16)data->KeyFields[8]->Usage.Keyboard != 0)
-					data->KeyCount++;
-			}
-		}
-	}
-
+	// Every report drained is decoded by KeyboardReportReceived.
 	return OK;
 }
 
+u32 KeyboardReadEvents(u32 keyboardAddress, struct KeyboardEvent *events, u32 count) {
+	u32 keyboardNumber, head, tail, read;
+	struct KeyboardDevice *data;
+	
+	keyboardNumber = KeyboardIndex(keyboardAddress);
+	if (keyboardNumber == 0xffffffff) return 0;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
+
+	tail = data->EventTail;
+	head = data->EventHead;
+	MemoryBarrier();
+	for (read = 0; read < count && tail != head; read++, tail++)
+		MemoryCopy(&events[read], &data->Events[tail & (KeyboardEventQueueSize - 1)], sizeof(struct KeyboardEvent));
+	MemoryBarrier();
+	data->EventTail = tail;
+	return read;
+}
+
 struct KeyboardModifiers KeyboardGetModifiers(u32 keyboardAddress) {
 	u32 keyboardNumber;
 	struct KeyboardDevice *data;
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return (struct KeyboardModifiers) { };
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 	return data->Modifiers;
 }
 
@@ -330,7 +451,7 @@ u32 KeyboardGetKeyDownCount(u32 keyboardAddress) {
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return 0;
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 	return data->KeyCount;
 }
 
@@ -340,20 +461,30 @@ bool KeyboadGetKeyIsDown(u32 keyboardAddress, u16 key) {
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return false;
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
-	for (u32 i = 0; i < data->KeyCount; i++)
-		if (data->Keys[i] == key) return true;
-	return false;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
+	if (key >= KeyboardKeyWords * 32) return false;
+	return (data->Keys[key / 32] & (1u << (key % 32))) != 0;
 }
 
 u16 KeyboardGetKeyDown(u32 keyboardAddress, u32 index) {
-	u32 keyboardNumber;
+	u32 keyboardNumber, keys, count;
 	struct KeyboardDevice *data;
 	u32 keyCount = KeyboardGetKeyDownCount(keyboardAddress);
 	
 	keyboardNumber = KeyboardIndex(keyboardAddress);
 	if (keyboardNumber == 0xffffffff) return 0;
-	data = (struct KeyboardDevice*)((struct HidDevice*)keyboards[keyboardNumber]->DriverData)->DriverData;
+	data = (struct KeyboardDevice*)HidGetDriverData(keyboards[keyboardNumber], DeviceDriverKeyboard);
 	if (index >= keyCount) return 0;
-	return data->Keys[index];
+	for (u32 i = 0; i < KeyboardKeyWords; i++) {
+		keys = data->Keys[i];
+		if (i == KeyboardLeftControl / 32)
+			keys &= ~(0xff << (KeyboardLeftControl % 32));
+		if (index < (count = KeyboardBitCount(keys))) {
+			while (index-- > 0)
+				keys &= keys - 1;
+			return i * 32 + __builtin_ctz(keys);
+		}
+		index -= count;
+	}
+	return 0;
 }
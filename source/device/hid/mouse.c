@@ -11,6 +11,7 @@
 *	a little awkwardly on purpose to make OS development more fun!
 ******************************************************************************/
 #include <device/hid/hid.h>
+#include <device/hid/input.h>
 #include <device/hid/mouse.h>
 #include <device/hid/report.h>
 #include <platform/platform.h>
@@ -33,7 +34,7 @@ void MouseLoad()
 		mouseAddresses[i] = 0;
 		mice[i] = NULL;
 	}
-	HidUsageAttach[DesktopMouse] = MouseAttach;
+	HidRegisterDriver(GenericDesktopControl, DesktopMouse, 0, 0, HidPriorityGeneric, MouseAttach);
 }
 
 u32 MouseIndex(u32 address) {
@@ -61,7 +62,7 @@ u32 MouseGetAddress(u32 index) {
 void MouseDetached(struct UsbDevice *device) {
 	struct MouseDevice *data;
 	
-	data = (struct MouseDevice*)((struct HidDevice*)device->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(device, DeviceDriverMouse);
 	if (data != NULL) {
 		if (mouseAddresses[data->Index] == device->Number) {
 			mouseAddresses[data->Index] = 0;
@@ -74,20 +75,163 @@ void MouseDetached(struct UsbDevice *device) {
 void MouseDeallocate(struct UsbDevice *device) {
 	struct MouseDevice *data;
 	
-	data = (struct MouseDevice*)((struct HidDevice*)device->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(device, DeviceDriverMouse);
 	if (data != NULL) {
+		HidUnbindDriver(device, DeviceDriverMouse);
 		MemoryDeallocate(data);
-		((struct HidDevice*)device->DriverData)->DriverData = NULL;
 	}
-	((struct HidDevice*)device->DriverData)->HidDeallocate = NULL;
-	((struct HidDevice*)device->DriverData)->HidDetached = NULL;
+}
+
+/**
+	\brief Returns the motion of an axis in the current report.
+
+	Relative axes report their motion directly, and absolute axes are 
+	compared with their last raw value. The clamped position cannot be used, 
+	as the device's logical range need not match it.
+*/
+s32 MouseAxisDelta(struct HidParserField *field, s32 last) {
+	if (field == NULL)
+		return 0;
+	if (field->Attributes.Relative)
+		return field->Value.S32;
+	return field->Value.S32 - last;
+}
+
+/**
+	\brief Returns the raw value to keep for an axis after the current report.
+*/
+s32 MouseAxisLast(struct HidParserField *field, s32 last) {
+	if (field == NULL || field->Attributes.Relative)
+		return last;
+	return field->Value.S32;
+}
+
+/**
+	\brief Moves a position, keeping it within 0 to 0x7fff.
+*/
+s16 MouseMove(s16 position, s32 delta) {
+	delta += position;
+	if (delta < 0)
+		return 0;
+	if (delta > 0x7fff)
+		return 0x7fff;
+	return delta;
+}
+
+/**
+	\brief Publishes the motion of an axis to the input event stream.
+
+	Relative axes publish their motion, and absolute axes their new value.
+*/
+void MousePublishAxis(struct UsbDevice *device, struct HidParserField *field, s32 delta, u64 time) {
+	if (field == NULL || delta == 0)
+		return;
+	if (field->Attributes.Relative)
+		InputPublish(device->Number, InputEventRelative, HidUsage(field->Usage.Page, field->Usage.Desktop), delta, time);
+	else
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(field->Usage.Page, field->Usage.Desktop), field->Value.S32, time);
+}
+
+void MouseReportReceived(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct MouseDevice *data;
+	struct HidParserField *field;
+	s32 x, y, wheel, pan;
+	u8 buttons, changed;
+	u64 time;
+	
+	data = (struct MouseDevice*)HidGetDriverData(device, DeviceDriverMouse);
+	if (data == NULL || report != data->MouseReport)
+		return;
+	time = record != NULL ? record->Time : MicroTime();
+
+	x = MouseAxisDelta(data->XField, data->LastX);
+	y = MouseAxisDelta(data->YField, data->LastY);
+	wheel = MouseAxisDelta(data->WheelField, data->LastWheel);
+	pan = MouseAxisDelta(data->PanField, data->LastPan);
+
+	buttons = 0;
+	for (u32 i = data->ButtonFirst; i < data->ButtonEnd; i++) {
+		field = &report->Fields[i];
+		if (field->Usage.Page == Button && field->Attributes.Variable &&
+			(u16)field->Usage.Desktop >= 1 && (u16)field->Usage.Desktop <= 8 && 
+			field->Value.Bool)
+			buttons |= 1 << ((u16)field->Usage.Desktop - 1);
+	}
+
+	MousePublishAxis(device, data->XField, x, time);
+	MousePublishAxis(device, data->YField, y, time);
+	MousePublishAxis(device, data->WheelField, wheel, time);
+	MousePublishAxis(device, data->PanField, pan, time);
+	changed = buttons ^ data->buttonState;
+	for (u32 i = 0; i < 8; i++)
+		if (changed & (1 << i))
+			InputPublish(device->Number, InputEventKey, HidUsage(Button, i + 1), (buttons >> i) & 1, time);
+	InputSync(device->Number, time);
+
+	data->buttonState = buttons;
+	data->LastX = MouseAxisLast(data->XField, data->LastX);
+	data->LastY = MouseAxisLast(data->YField, data->LastY);
+	data->LastWheel = MouseAxisLast(data->WheelField, data->LastWheel);
+	data->LastPan = MouseAxisLast(data->PanField, data->LastPan);
+	data->mouseX = MouseMove(data->mouseX, x);
+	data->mouseY = MouseMove(data->mouseY, y);
+	data->wheel += wheel;
+	data->pan += pan;
+	data->Deltas.X += x;
+	data->Deltas.Y += y;
+	data->Deltas.Wheel += wheel;
+	data->Deltas.Pan += pan;
+	data->Deltas.Buttons = buttons;
+}
+
+/**
+	\brief Finds the fields of a mouse report.
+
+	Records the axis and button fields of report in data. Returns false if 
+	the report has no X and Y axes.
+*/
+bool MouseFindFields(struct MouseDevice *data, struct HidParserReport *report) {
+	struct HidParserField *field;
+
+	data->XField = data->YField = data->WheelField = data->PanField = NULL;
+	data->ButtonFirst = data->ButtonEnd = 0;
+	for (u32 i = 0; i < report->FieldCount; i++) {
+		field = &report->Fields[i];
+		if (!field->Attributes.Variable || field->Attributes.Constant)
+			continue;
+		switch (field->Usage.Page) {
+		case GenericDesktopControl:
+			if (field->Usage.Desktop == DesktopX && data->XField == NULL)
+				data->XField = field;
+			else if (field->Usage.Desktop == DesktopY && data->YField == NULL)
+				data->YField = field;
+			else if (field->Usage.Desktop == DesktopWheel && data->WheelField == NULL)
+				data->WheelField = field;
+			break;
+		case Consumer:
+			if (field->Usage.Consumer == ConsumerAcPan && data->PanField == NULL)
+				data->PanField = field;
+			break;
+		case Button:
+			if (data->ButtonEnd == 0)
+				data->ButtonFirst = i;
+			data->ButtonEnd = i + 1;
+			break;
+		default:
+			break;
+		}
+	}
+	return data->XField != NULL && data->YField != NULL;
 }
 
 Result MouseAttach(struct UsbDevice *device, u32 interface) {
 	u32 mouseNumber;
 	struct HidDevice *hidData;
+	struct HidBinding *binding;
 	struct MouseDevice *data;
 	struct HidParserResult *parse;
+	struct HidParserReport *report;
+	struct HidFullUsage usage;
 
 	if ((MouseMaxMice & 3) != 0) {
 		LOG("MOUSE: Warning! MouseMaxMice not a multiple of 4. The driver wasn't built for this!\n");
@@ -104,8 +248,7 @@ Result MouseAttach(struct UsbDevice *device, u32 interface) {
 	}
 
 	parse = hidData->ParserResult;
-	if (parse->Application.Page != GenericDesktopControl ||
-		parse->Application.Desktop != DesktopMouse) {
+	if (hidData->Application != HidUsage(GenericDesktopControl, DesktopMouse)) {
 		LOGF("MOUSE: %s doesn't seem to be a mouse...\n", UsbGetDescription(device));
 		return ErrorIncompatible;
 	}
@@ -113,16 +256,34 @@ Result MouseAttach(struct UsbDevice *device, u32 interface) {
 		LOGF("MOUSE: %s doesn't have enough outputs to be a mouse.\n", UsbGetDescription(device));
 		return ErrorIncompatible;
 	}
-	hidData->HidDetached = MouseDetached;
-	hidData->HidDeallocate = MouseDeallocate;
-	
-	if ((hidData->DriverData = MemoryAllocate(sizeof(struct MouseDevice))) == NULL) {
+
+	if ((data = MemoryAllocate(sizeof(struct MouseDevice))) == NULL) {
 		LOGF("MOUSE: Not enough memory to allocate mouse %s.\n", UsbGetDescription(device));
 		return ErrorMemory;
 	}
-	data = (struct MouseDevice*)hidData->DriverData;
 	data->Header.DeviceDriver = DeviceDriverMouse;
 	data->Header.DataSize = sizeof(struct MouseDevice);
+	if ((binding = HidBindDriver(device, (struct UsbDriverDataHeader*)data)) == NULL) {
+		LOGF("MOUSE: %s not connected. Too many drivers bound to it.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+	binding->HidDetached = MouseDetached;
+	binding->HidDeallocate = MouseDeallocate;
+	binding->HidReportReceived = MouseReportReceived;
+
+	usage.Page = GenericDesktopControl;
+	usage.Desktop = DesktopX;
+	if (HidFindField(parse, usage, &report, NULL) != NULL &&
+		report->Type == Input && MouseFindFields(data, report)) {
+		LOG_DEBUGF("MOUSE: Input report %d. %d fields.\n", report->Index, report->FieldCount);
+		data->MouseReport = report;
+	} else {
+		LOGF("MOUSE: %s has no report with X and Y axes.\n", UsbGetDescription(device));
+		MouseDeallocate(device);
+		return ErrorIncompatible;
+	}
+
 	data->Index = mouseNumber = 0xffffffff;
 	for (u32 i = 0; i < MouseMaxMice; i++) {
 		if (mouseAddresses[i] == 0) {
@@ -141,19 +302,13 @@ Result MouseAttach(struct UsbDevice *device, u32 interface) {
 
 	mice[mouseNumber] = device;
 
-	for (u32 i = 0; i < parse->ReportCount; i++) {
-		if (parse->Report[i]->Type == Input 
-//		    && data->MouseReport == NULL
-		) {
-			LOG_DEBUGF("MOUSE: Output report %d. %d fields.\n", i, parse->Report[i]->FieldCount);
-			data->MouseReport = parse->Report[i];
-		} 
-	}
-
 	data->mouseX = 0;
 	data->mouseY = 0;
 	data->wheel = 0;
+	data->pan = 0;
 	data->buttonState = 0;
+	data->LastX = data->LastY = data->LastWheel = data->LastPan = 0;
+	MemorySet(&data->Deltas, 0, sizeof(struct MouseDeltas));
 
 	LOG_DEBUGF("MOUSE: New mouse assigned %d!\n", device->Number);
 
@@ -171,30 +326,16 @@ Result MousePoll(u32 mouseAddress) {
 	
 	mouseNumber = MouseIndex(mouseAddress);	
 	if (mouseNumber == 0xffffffff) return ErrorDisconnected;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	if ((result = HidReadDevice(mice[mouseNumber], data->MouseReport->Index)) != OK) {
+		if (result == ErrorRetry)
+			return OK;
 		if (result != ErrorDisconnected)
-			LOGF("MOUSE: Could not get mouse report from %s.\n", UsbGetDescription(mice[mouseNumber]));
+			LOG_WARNINGF("MOUSE: Could not get mouse report from %s.\n", UsbGetDescription(mice[mouseNumber]));
 		return result;
 	}
 
-	struct HidParserReport *MouseReport = data->MouseReport;
-	if (MouseReport->Type == Input) {
-		// XXX: I'm sure I should be using HidGetFieldValue()
-		// But this was so terribly easy.
-		u8 *ReportBuffer = MouseReport->ReportBuffer;
-		data->buttonState = (u8)ReportBuffer[0];
-		data->mouseX += (s8)ReportBuffer[1];
-		data->mouseY += (s8)ReportBuffer[2];
-		data->wheel += (s8)ReportBuffer[3];
-		if (data->mouseX < 0) {
-			data->mouseX = 0;
-		}
-		if (data->mouseY < 0) {
-			data->mouseY = 0;
-		}
-	}
-
+	// Every report drained is accumulated by MouseReportReceived.
 	return OK;
 }
 
@@ -204,7 +345,7 @@ s16 MouseGetPositionX(u32 mouseAddress) {
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	return data->mouseX;
 }
 
@@ -214,7 +355,7 @@ s16 MouseGetPositionY(u32 mouseAddress) {
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	return data->mouseY;
 }
 
@@ -224,17 +365,39 @@ s16 MouseGetWheel(u32 mouseAddress) {
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	return data->wheel;
 }
 
+s16 MouseGetPan(u32 mouseAddress) {
+	u32 mouseNumber;
+	struct MouseDevice *data;
+	
+	mouseNumber = MouseIndex(mouseAddress);
+	if (mouseNumber == 0xffffffff) return 0;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
+	return data->pan;
+}
+
+Result MouseReadDeltas(u32 mouseAddress, struct MouseDeltas *deltas) {
+	u32 mouseNumber;
+	struct MouseDevice *data;
+	
+	mouseNumber = MouseIndex(mouseAddress);
+	if (mouseNumber == 0xffffffff) return ErrorDisconnected;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
+	MemoryCopy(deltas, &data->Deltas, sizeof(struct MouseDeltas));
+	data->Deltas.X = data->Deltas.Y = data->Deltas.Wheel = data->Deltas.Pan = 0;
+	return OK;
+}
+
 u32 MouseGetPosition(u32 mouseAddress) {
 	u32 mouseNumber;
 	struct MouseDevice *data;
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	return (data->mouseX << 16) | (data->mouseY & 0xFFFF);  /* x is high 16 bits; y is low 16 bits */
 }
 
@@ -244,7 +407,7 @@ u8 MouseGetButtons(u32 mouseAddress) {
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 	return data->buttonState;
 }
 
@@ -254,7 +417,7 @@ bool MouseGetButtonIsPressed(u32 mouseAddress, enum MouseDeviceButton button) {
 	
 	mouseNumber = MouseIndex(mouseAddress);
 	if (mouseNumber == 0xffffffff) return 0;
-	data = (struct MouseDevice*)((struct HidDevice*)mice[mouseNumber]->DriverData)->DriverData;
+	data = (struct MouseDevice*)HidGetDriverData(mice[mouseNumber], DeviceDriverMouse);
 
 	switch (button) {
 		case MouseDeviceButtonLeft:
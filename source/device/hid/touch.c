@@ -1,52 +1,248 @@
 /******************************************************************************
-*	device/hid/keyboard.c
+*	device/hid/touch.c
 *	 by Alex Chadwick
 *
 *	A light weight implementation of the USB protocol stack fit for a simple
 *	driver.
 *
-*	device/hid/keyboard.c contains code relating to USB hid keyboards. The 
-*	driver maintains a list of the keyboards on the system, and allows the 
-*	operating system to retrieve the status of each one separately. It is coded
-*	a little awkwardly on purpose to make OS development more fun!
+*	device/hid/touch.c contains code relating to USB hid touch screens. The
+*	driver finds the contacts in the digitizer report from the parsed report
+*	descriptor, so that any panel which follows the HID usage tables works,
+*	and reports all simultaneous contacts from each report.
 ******************************************************************************/
 #include <device/hid/hid.h>
+#include <device/hid/input.h>
 #include <device/hid/touch.h>
 #include <device/hid/report.h>
 #include <platform/platform.h>
 #include <types.h>
-#include <string.h>
 #include <usbd/device.h>
 #include <usbd/usbd.h>
 
-struct UsbDevice* touchDev = NULL;
+u32 touchCount __attribute__((aligned(4))) = 0;
+u32 touchAddresses[TouchMaxTouches] = { 0, 0, 0, 0 };
+struct UsbDevice* touches[TouchMaxTouches];
+u32 touchNext = 0;
 
-void TouchLoad() 
+void TouchLoad()
 {
-	LOG_DEBUG("CSUD: Touch driver version 0.1\n"); 
-	HidUsageAttach[4] = TouchAttach;
+	LOG_DEBUG("CSUD: Touch driver version 0.1\n");
+	touchCount = 0;
+	touchNext = 0;
+	for (u32 i = 0; i < TouchMaxTouches; i++)
+	{
+		touchAddresses[i] = 0;
+		touches[i] = NULL;
+	}
+	HidRegisterDriver(Digitlizer, DigitlizerTouchScreen, 0, 0, HidPriorityGeneric, TouchAttach);
+}
+
+u32 TouchIndex(u32 address) {
+	if (address == 0) return 0xffffffff;
+
+	for (u32 i = 0; i < TouchMaxTouches; i++)
+		if (touchAddresses[i] == address)
+			return i;
+
+	return 0xffffffff;
+}
+
+u32 TouchGetAddress(u32 index) {
+	if (index > touchCount) return 0;
+
+	for (u32 i = 0; i < TouchMaxTouches; i++) {
+		if (touchAddresses[i] != 0)
+			if (index-- == 0)
+				return touchAddresses[i];
+	}
+
+	return 0;
+}
+
+u32 TouchCount() {
+	return touchCount;
 }
 
 void TouchDetached(struct UsbDevice *device) {
 	struct TouchDevice *data;
-	touchDev = NULL;
+	
+	data = (struct TouchDevice*)HidGetDriverData(device, DeviceDriverTouch);
+	if (data != NULL) {
+		if (touchAddresses[data->Index] == device->Number) {
+			touchAddresses[data->Index] = 0;
+			touchCount--;
+			touches[data->Index] = NULL;
+		}
+	}
 }
 
 void TouchDeallocate(struct UsbDevice *device) {
 	struct TouchDevice *data;
-	data = (struct KeyboardDevice*)((struct HidDevice*)device->DriverData)->DriverData;
+
+	data = (struct TouchDevice*)HidGetDriverData(device, DeviceDriverTouch);
 	if (data != NULL) {
+		HidUnbindDriver(device, DeviceDriverTouch);
 		MemoryDeallocate(data);
-		((struct HidDevice*)device->DriverData)->DriverData = NULL;
 	}
-	((struct HidDevice*)device->DriverData)->HidDeallocate = NULL;
-	((struct HidDevice*)device->DriverData)->HidDetached = NULL;
+}
+
+/**
+	\brief Finds the contacts in an input report.
+
+	Groups the fields of the report into contacts, each of which starts at a
+	tip switch. Returns the number of contacts found.
+*/
+u32 TouchFindContacts(struct TouchDevice *data, struct HidParserReport *report) {
+	struct HidParserField *field;
+	struct TouchContactFields *contact;
+	u32 count;
+
+	count = 0;
+	contact = NULL;
+	data->ContactCount = NULL;
+	for (u32 i = 0; i < report->FieldCount; i++) {
+		field = &report->Fields[i];
+		if (!field->Attributes.Variable || field->Attributes.Constant)
+			continue;
+		if (field->Usage.Page == Digitlizer) {
+			switch (field->Usage.Digitlizer) {
+			case DigitlizerTipSwitch:
+				if (count == TouchMaxContacts) {
+					contact = NULL;
+					break;
+				}
+				contact = &data->ContactFields[count++];
+				contact->Tip = field;
+				contact->Id = contact->X = contact->Y = NULL;
+				contact->Width = contact->Height = NULL;
+				break;
+			case DigitlizerContactIdentifier:
+				if (contact != NULL && contact->Id == NULL)
+					contact->Id = field;
+				break;
+			case DigitlizerWidth:
+				if (contact != NULL && contact->Width == NULL)
+					contact->Width = field;
+				break;
+			case DigitlizerHeight:
+				if (contact != NULL && contact->Height == NULL)
+					contact->Height = field;
+				break;
+			case DigitlizerContactCount:
+				data->ContactCount = field;
+				break;
+			default:
+				break;
+			}
+		} else if (field->Usage.Page == GenericDesktopControl && contact != NULL) {
+			if (field->Usage.Desktop == DesktopX && contact->X == NULL)
+				contact->X = field;
+			else if (field->Usage.Desktop == DesktopY && contact->Y == NULL)
+				contact->Y = field;
+		}
+	}
+
+	// A contact without coordinates is of no use, and ends the search.
+	for (u32 i = 0; i < count; i++)
+		if (data->ContactFields[i].X == NULL || data->ContactFields[i].Y == NULL)
+			return i;
+	return count;
+}
+
+/**
+	\brief Queues the frame being gathered.
+
+	Adds the current frame to the queue of frames for TouchGetContacts,
+	dropping the oldest if it is full, and starts the next.
+*/
+void TouchQueueFrame(struct TouchDevice *data) {
+	u32 head;
+
+	head = data->QueueHead;
+	if (head - data->QueueTail >= TouchQueueSize)
+		data->QueueTail++;
+	MemoryCopy(&data->Queue[head & (TouchQueueSize - 1)], &data->Frame, sizeof(struct TouchReport));
+	data->QueueHead = head + 1;
+	data->Frame.Count = 0;
+	data->ContactsExpected = 0;
+}
+
+/**
+	\brief Publishes the frame being gathered to the input event stream.
+
+	Each contact is published as its identifier, then its position and tip
+	switch, in the manner of the multi-touch slots of evdev.
+*/
+void TouchPublishFrame(struct UsbDevice *device, struct TouchDevice *data, u64 time) {
+	struct TouchContact *contact;
+
+	for (u32 i = 0; i < data->Frame.Count; i++) {
+		contact = &data->Frame.Contacts[i];
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(Digitlizer, DigitlizerContactIdentifier), contact->Id, time);
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(GenericDesktopControl, DesktopX), contact->X, time);
+		InputPublish(device->Number, InputEventAbsolute, HidUsage(GenericDesktopControl, DesktopY), contact->Y, time);
+		InputPublish(device->Number, InputEventKey, HidUsage(Digitlizer, DigitlizerTipSwitch), contact->Tip, time);
+	}
+	InputSync(device->Number, time);
+}
+
+void TouchReportReceived(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct TouchDevice *data;
+	struct TouchContactFields *fields;
+	struct TouchContact *contact;
+	u32 count, down;
+	bool tip;
+
+	data = (struct TouchDevice*)HidGetDriverData(device, DeviceDriverTouch);
+	if (data == NULL || report != data->Report)
+		return;
+
+	if (data->ContactCount != NULL) {
+		count = data->ContactCount->Value.U32;
+		if (count != 0) {
+			data->Frame.Count = 0;
+			data->ContactsExpected = Min(count, TouchMaxContacts, u32);
+		}
+	}
+
+	down = 0;
+	for (u32 i = 0; i < data->ContactFieldCount; i++) {
+		fields = &data->ContactFields[i];
+		tip = fields->Tip->Value.U32 != 0;
+		if (data->ContactCount != NULL) {
+			if (data->Frame.Count >= data->ContactsExpected)
+				break;
+		} else if (!tip && (data->ContactsDown & (1 << i)) == 0)
+			continue;
+		if (tip) down |= 1 << i;
+
+		contact = &data->Frame.Contacts[data->Frame.Count++];
+		contact->Id = fields->Id != NULL ? fields->Id->Value.U32 : i;
+		contact->Tip = tip;
+		contact->X = fields->X->Value.U32;
+		contact->Y = fields->Y->Value.U32;
+		contact->Width = fields->Width != NULL ? fields->Width->Value.U32 : 0;
+		contact->Height = fields->Height != NULL ? fields->Height->Value.U32 : 0;
+	}
+	data->ContactsDown = down;
+
+	if (data->ContactCount == NULL || data->Frame.Count >= data->ContactsExpected) {
+		TouchPublishFrame(device, data, record != NULL ? record->Time : MicroTime());
+		TouchQueueFrame(data);
+	}
 }
 
 Result TouchAttach(struct UsbDevice *device, u32 interface) {
-	u32 keyboardNumber;
 	struct HidDevice *hidData;
+	struct HidBinding *binding;
+	struct TouchDevice *data;
 	struct HidParserResult *parse;
+	u32 count, best, touchNumber;
+
+	if (touchCount == TouchMaxTouches) {
+		LOGF("TOUCH: %s not connected. Too many touch devices connected (%d/%d). Change TouchMaxTouches in device/hid/touch.h to allow more.\n", UsbGetDescription(device), touchCount, TouchMaxTouches);
+		return ErrorIncompatible;
+	}
 
 	hidData = (struct HidDevice*)device->DriverData;
 	if (hidData->Header.DeviceDriver != DeviceDriverHid) {
@@ -55,106 +251,145 @@ Result TouchAttach(struct UsbDevice *device, u32 interface) {
 	}
 
 	parse = hidData->ParserResult;
-	if ((parse->Application.Page != Digitlizer && parse->Application.Page != Undefined) ||
-		parse->Application.Digitlizer != 4) {
-		LOGF("TOUCH: %s doesn't seem to be a touch (%x != %x || %x != %x)...\n", UsbGetDescription(device), parse->Application.Page, Digitlizer, parse->Application.Digitlizer, 4);
+	if (hidData->Application != HidUsage(Digitlizer, DigitlizerTouchScreen)) {
+		LOGF("TOUCH: %s doesn't seem to be a touch (%x != %x)...\n", UsbGetDescription(device), hidData->Application, HidUsage(Digitlizer, DigitlizerTouchScreen));
 		return ErrorIncompatible;
 	}
 	if (parse->ReportCount < 1) {
 		LOGF("TOUCH: %s doesn't have enough outputs to be a touch.\n", UsbGetDescription(device));
 		return ErrorIncompatible;
 	}
-	hidData->HidDetached = TouchDetached;
-	hidData->HidDeallocate = TouchDeallocate;
-	if ((hidData->DriverData = MemoryAllocate(sizeof(struct TouchDevice))) == NULL) {
+
+	if ((data = MemoryAllocate(sizeof(struct TouchDevice))) == NULL) {
 		LOGF("TOUCH: Not enough memory to allocate touch %s.\n", UsbGetDescription(device));
 		return ErrorMemory;
 	}
-	touchDev = device;
-	LOG_DEBUGF("TOUCH: New Touch assigned %d!\n", device->Number);
+	MemorySet(data, 0, sizeof(struct TouchDevice));
+
+	// Use the input report with the most contacts, for panels which also
+	// have pen or mouse reports.
+	best = 0;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		if (parse->Report[i]->Type != Input) continue;
+		if ((count = TouchFindContacts(data, parse->Report[i])) > best) {
+			best = count;
+			data->Report = parse->Report[i];
+		}
+	}
+	if (best == 0) {
+		LOGF("TOUCH: %s has no contacts with a tip switch and coordinates.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+	data->ContactFieldCount = TouchFindContacts(data, data->Report);
+	data->Header.DeviceDriver = DeviceDriverTouch;
+	data->Header.DataSize = sizeof(struct TouchDevice);
+	data->Frame.MaximumX = data->ContactFields[0].X->LogicalMaximum;
+	data->Frame.MaximumY = data->ContactFields[0].Y->LogicalMaximum;
+	data->Frame.Device = device->Number;
+	data->Event.device = device->Number;
+	if ((binding = HidBindDriver(device, (struct UsbDriverDataHeader*)data)) == NULL) {
+		LOGF("TOUCH: %s not connected. Too many drivers bound to it.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+
+	data->Index = touchNumber = 0xffffffff;
+	for (u32 i = 0; i < TouchMaxTouches; i++) {
+		if (touchAddresses[i] == 0) {
+			data->Index = touchNumber = i;
+			touchAddresses[i] = device->Number;
+			touchCount++;
+			break;
+		}
+	}
+
+	if (touchNumber == 0xffffffff) {
+		LOG("TOUCH: PANIC! Driver in inconsistent state! TouchCount is inaccurate.\n");
+		TouchDeallocate(device);
+		return ErrorGeneral;
+	}
+
+	touches[touchNumber] = device;
+	binding->HidDetached = TouchDetached;
+	binding->HidDeallocate = TouchDeallocate;
+	binding->HidReportReceived = TouchReportReceived;
+	LOG_DEBUGF("TOUCH: New Touch assigned %d with %d contacts in report %d!\n", device->Number, data->ContactFieldCount, data->Report->Id);
 
 	return OK;
 }
 
+Result TouchPoll(u32 touchAddress) {
+	u32 touchNumber;
+	Result result;
+	struct TouchDevice *data;
+	
+	touchNumber = TouchIndex(touchAddress);
+	if (touchNumber == 0xffffffff) return ErrorDisconnected;
+	data = (struct TouchDevice*)HidGetDriverData(touches[touchNumber], DeviceDriverTouch);
+	if ((result = HidReadDevice(touches[touchNumber], data->Report->Index)) != OK) {
+		if (result == ErrorRetry)
+			return OK;
+		if (result != ErrorDisconnected)
+			LOG_WARNINGF("TOUCH: Could not get touch report from %s.\n", UsbGetDescription(touches[touchNumber]));
+		return result;
+	}
+
+	// Every report drained is queued by TouchReportReceived.
+	return OK;
+}
 
-Result TouchPoll(u32 keyboardAddress) {
+Result TouchGetContacts(u32 touchAddress, struct TouchReport *report) {
+	u32 touchNumber;
+	struct TouchDevice *data;
+	Result result;
 
+	if ((result = TouchPoll(touchAddress)) != OK)
+		return result;
+
+	touchNumber = TouchIndex(touchAddress);
+	data = (struct TouchDevice*)HidGetDriverData(touches[touchNumber], DeviceDriverTouch);
+	if (data->QueueTail == data->QueueHead)
+		return ErrorRetry;
+	MemoryCopy(report, &data->Queue[data->QueueTail & (TouchQueueSize - 1)], sizeof(struct TouchReport));
+	data->QueueTail++;
 	return OK;
 }
 
-static struct TouchEvent _event = {0};
 Result TouchGetEvent(struct TouchEvent* event){
-	u8 buffer[128] = {0};
-	Result ret;
+	struct TouchDevice *data;
+	struct TouchReport report;
+	u32 touchNumber;
+	Result result;
 
-	if(touchDev == NULL)
+	if (touchCount == 0)
 		return ErrorDevice;
 
-	if(touchDev->Descriptor.ProductId == 0xe2e4){
-		ret = HidReadDeviceRaw(touchDev, 2, 0, buffer);
-		if(ret == 0){
-			_event.event = !!(buffer[1]&0x01);
-			int a = buffer[3];
-			int b = buffer[4];
-			int c = b*256 + a;
-			_event.x = c;
-			a = buffer[5];
-			b = buffer[6];
-			c = b*256 + a;
-			_event.y = c;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}else if(_event.event){
-			_event.event = 0;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}
-	}else if (touchDev->Descriptor.ProductId == 0x9){
-		ret = HidReadDeviceRaw(touchDev, 1, 4, buffer);
-		if(ret == 0){
-			_event.event = !!(buffer[1]&0x40);
-			int a = buffer[2];
-			int b = buffer[3];
-			int c = b*256 + a;
-			_event.x = c;
-			a = buffer[4];
-			b = buffer[5];
-			c = b*256 + a;
-			_event.y = c;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}else if(_event.event){
-			_event.event = 0;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}
-	}else if (touchDev->Descriptor.ProductId == 0xa){
-		ret = HidReadDeviceRaw(touchDev, 2, 1, buffer);
-		if(ret == 0){
-			_event.event = !!(buffer[1]&0x40);
-			int a = buffer[2];
-			int b = buffer[3];
-			int c = b*256 + a;
-			_event.x = c;
-			a = buffer[4];
-			b = buffer[5];
-			c = b*256 + a;
-			_event.y = c;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}else if(_event.event){
-			_event.event = 0;
-			memcpy(event, &_event, sizeof(struct TouchEvent));
-			return OK;
-		}
-	}else{
-		//Unknow device
-		return ErrorDevice;
+	// Start after the device last reported, so a busy panel cannot starve
+	// the others.
+	result = ErrorRetry;
+	for (u32 i = 0; i < TouchMaxTouches && result != OK; i++) {
+		touchNumber = (touchNext + i) % TouchMaxTouches;
+		if (touchAddresses[touchNumber] != 0)
+			result = TouchGetContacts(touchAddresses[touchNumber], &report);
 	}
-	return ret;
-}
+	if (result != OK)
+		return result;
+	touchNext = touchNumber + 1;
 
+	data = (struct TouchDevice*)HidGetDriverData(touches[touchNumber], DeviceDriverTouch);
+	if (report.Count > 0) {
+		data->Event.event = report.Contacts[0].Tip;
+		data->Event.x = report.Contacts[0].X;
+		data->Event.y = report.Contacts[0].Y;
+		data->Event.size_x = report.Contacts[0].Width;
+		data->Event.size_y = report.Contacts[0].Height;
+	} else
+		data->Event.event = 0;
+	MemoryCopy(event, &data->Event, sizeof(struct TouchEvent));
+	return OK;
+}
 
 bool TouchPersent(){
-	return !!touchDev;
+	return touchCount > 0;
 }
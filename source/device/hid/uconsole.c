@@ -1,6 +1,19 @@
-//uconsole multi function device
+/******************************************************************************
+*	device/hid/uconsole.c
+*	 by Alex Chadwick
+*
+*	A light weight implementation of the USB protocol stack fit for a simple
+*	driver.
+*
+*	device/hid/uconsole.c contains code relating to the uConsole multi
+*	function device. Its keyboard, mouse and game pad each send their own
+*	report, which the driver decodes from the parsed fields into a queue of
+*	events, one for each control that changes.
+******************************************************************************/
 #include <device/hid/hid.h>
+#include <device/hid/input.h>
 #include <device/hid/report.h>
+#include <device/hid/uconsole.h>
 #include <platform/platform.h>
 #include <types.h>
 #include <usbd/device.h>
@@ -8,43 +21,261 @@
 
 struct UsbDevice* uconsoleDev = NULL;
 
-Result uConsoleAttach(struct UsbDevice *device, u32 interface) {
-    if(device->Descriptor.ProductId == 0x24 && device->Descriptor.VendorId == 0x1EAF){
-   	    LOG_DEBUG("uConsole Attach\n");  
-        uconsoleDev = device;
-        return OK;
-    }
-    return ErrorDevice;
+void uConsoleLoad()
+{
+	LOG_DEBUG("CSUD: uConsole MFD driver version 0.1\n");
+	uconsoleDev = NULL;
+	HidRegisterDriver(GenericDesktopControl, DesktopKeyboard, UConsoleVendorId, UConsoleProductId, HidPriorityDevice, uConsoleAttach);
+	HidRegisterDriver(GenericDesktopControl, DesktopMouse, UConsoleVendorId, UConsoleProductId, HidPriorityDevice, uConsoleAttach);
+	HidRegisterDriver(GenericDesktopControl, DesktopGamePad, UConsoleVendorId, UConsoleProductId, HidPriorityDevice, uConsoleAttach);
 }
 
-void uConsoleLoad() 
-{
-	LOG_DEBUG("CSUD: uConsole MFD driver version 0.1\n"); 
-	HidUsageAttach[DesktopMouse] = uConsoleAttach;
+void uConsoleDetached(struct UsbDevice *device) {
+	if (uconsoleDev == device)
+		uconsoleDev = NULL;
+}
+
+void uConsoleDeallocate(struct UsbDevice *device) {
+	struct UConsoleDevice *data;
+
+	data = (struct UConsoleDevice*)HidGetDriverData(device, DeviceDriverUConsole);
+	if (data != NULL) {
+		HidUnbindDriver(device, DeviceDriverUConsole);
+		MemoryDeallocate(data);
+	}
+}
+
+/**
+	\brief Queues an event.
+
+	Adds an event to the queue, or counts it as lost if the queue is full,
+	and publishes it to the input event stream as type. Only called when 
+	reports are received, so there is only ever one writer.
+*/
+void uConsoleQueueEvent(struct UsbDevice *device, struct UConsoleDevice *data, u64 time, enum UConsoleSource source, 
+	enum InputEventType type, struct HidFullUsage usage, s32 value) {
+	struct UConsoleEvent *event;
+	u32 head;
+
+	InputPublish(device->Number, type, HidUsage(usage.Page, usage.Desktop), value, time);
+	head = data->EventHead;
+	if (head - data->EventTail >= UConsoleEventQueueSize) {
+		data->EventOverflows++;
+		return;
+	}
+
+	event = &data->Events[head & (UConsoleEventQueueSize - 1)];
+	event->Time = time;
+	event->Source = source;
+	event->Usage = usage;
+	event->Value = value;
+	MemoryBarrier();
+	data->EventHead = head + 1;
+}
+
+/**
+	\brief Returns the usage an element of an array field selects.
+
+	Returns the extended usage, as made by HidUsage, or 0 if the element 
+	selects no control.
+*/
+u32 uConsoleArrayUsage(struct HidParserField *field, u32 index) {
+	struct HidFullUsage usage;
+
+	usage = HidGetArrayUsage(field, HidGetFieldValue(field, index));
+	if ((u16)usage.Desktop == 0)
+		return 0;
+	return HidUsage(usage.Page, usage.Desktop);
+}
+
+/**
+	\brief Compares an array field with its last value.
+
+	Queues a press for each usage in the field that was not in previous, and
+	a release for each in previous that is no longer in the field, then
+	updates previous, which holds extended usages. Usage 0 means no control.
+*/
+void uConsoleDiffArray(struct UsbDevice *device, struct UConsoleDevice *data, u64 time, enum UConsoleSource source, struct HidParserField *field, s32 *previous) {
+	struct HidFullUsage usage;
+	u32 i, j, code;
+
+	if (uConsoleArrayUsage(field, 0) == HidUsage(KeyboardControl, KeyboardErrorRollOver))
+		return;
+
+	for (i = 0; i < field->Count; i++) {
+		if (previous[i] == 0) continue;
+		for (j = 0; j < field->Count; j++)
+			if (uConsoleArrayUsage(field, j) == (u32)previous[i]) break;
+		if (j == field->Count) {
+			*(u32*)&usage = previous[i];
+			uConsoleQueueEvent(device, data, time, source, InputEventKey, usage, 0);
+		}
+	}
+	for (j = 0; j < field->Count; j++) {
+		code = uConsoleArrayUsage(field, j);
+		if (code == 0) continue;
+		for (i = 0; i < field->Count; i++)
+			if ((u32)previous[i] == code) break;
+		if (i == field->Count) {
+			*(u32*)&usage = code;
+			uConsoleQueueEvent(device, data, time, source, InputEventKey, usage, 1);
+		}
+	}
+	for (j = 0; j < field->Count; j++)
+		previous[j] = uConsoleArrayUsage(field, j);
+}
+
+void uConsoleReportReceived(struct UsbDevice *device, struct HidParserReport *report, struct HidReportRecord *record) {
+	struct UConsoleDevice *data;
+	struct HidParserField *field;
+	enum UConsoleSource source;
+	s32 *values, value;
+	u64 time;
+
+	data = (struct UConsoleDevice*)HidGetDriverData(device, DeviceDriverUConsole);
+	if (data == NULL || report->Type != Input)
+		return;
+	time = record != NULL ? record->Time : MicroTime();
+
+	source = UConsoleSourceOther;
+	if (report->Application.Page == GenericDesktopControl) {
+		switch (report->Application.Desktop) {
+		case DesktopKeyboard:
+		case DesktopKeypad:
+			source = UConsoleSourceKeyboard;
+			break;
+		case DesktopMouse:
+		case DesktopPoint:
+			source = UConsoleSourceMouse;
+			break;
+		case DesktopJoystick:
+		case DesktopGamePad:
+			source = UConsoleSourceGamePad;
+			break;
+		default:
+			break;
+		}
+	}
+
+	values = data->Values + data->ValueBase[report->Index];
+	for (u32 i = 0; i < report->FieldCount; i++) {
+		field = &report->Fields[i];
+		if (field->Attributes.Constant) {
+			values += field->Count;
+			continue;
+		}
+		if (!field->Attributes.Variable) {
+			uConsoleDiffArray(device, data, time, source, field, values);
+			values += field->Count;
+			continue;
+		}
+		value = field->Value.S32;
+		if (field->Attributes.Relative) {
+			if (value != 0)
+				uConsoleQueueEvent(device, data, time, source, InputEventRelative, field->Usage, value);
+		} else if (value != *values)
+			uConsoleQueueEvent(device, data, time, source, 
+				field->Size == 1 ? InputEventKey : InputEventAbsolute, field->Usage, value);
+		*values++ = value;
+	}
+	InputSync(device->Number, time);
+}
+
+Result uConsoleAttach(struct UsbDevice *device, u32 interface) {
+	struct HidDevice *hidData;
+	struct HidBinding *binding;
+	struct UConsoleDevice *data;
+	struct HidParserResult *parse;
+	u32 count, size;
+
+	hidData = (struct HidDevice*)device->DriverData;
+	parse = hidData->ParserResult;
+	if (uconsoleDev != NULL) {
+		LOGF("UCONSOLE: %s not connected. Only one uConsole is supported.\n", UsbGetDescription(device));
+		return ErrorIncompatible;
+	}
+
+	count = 0;
+	for (u32 i = 0; i < parse->ReportCount; i++)
+		if (parse->Report[i]->Type == Input)
+			for (u32 j = 0; j < parse->Report[i]->FieldCount; j++)
+				count += parse->Report[i]->Fields[j].Count;
+
+	size = sizeof(struct UConsoleDevice) + sizeof(u32) * parse->ReportCount + sizeof(s32) * count;
+	if ((data = MemoryAllocate(size)) == NULL) {
+		LOGF("UCONSOLE: Not enough memory to allocate uConsole %s.\n", UsbGetDescription(device));
+		return ErrorMemory;
+	}
+	MemorySet(data, 0, size);
+	data->Header.DeviceDriver = DeviceDriverUConsole;
+	data->Header.DataSize = sizeof(struct UConsoleDevice);
+	data->ValueBase = (u32*)(data + 1);
+	data->Values = (s32*)(data->ValueBase + parse->ReportCount);
+	count = 0;
+	for (u32 i = 0; i < parse->ReportCount; i++) {
+		data->ValueBase[i] = count;
+		if (parse->Report[i]->Type == Input)
+			for (u32 j = 0; j < parse->Report[i]->FieldCount; j++)
+				count += parse->Report[i]->Fields[j].Count;
+	}
+	data->EventHead = data->EventTail = data->EventOverflows = 0;
+	if ((binding = HidBindDriver(device, (struct UsbDriverDataHeader*)data)) == NULL) {
+		LOGF("UCONSOLE: %s not connected. Too many drivers bound to it.\n", UsbGetDescription(device));
+		MemoryDeallocate(data);
+		return ErrorIncompatible;
+	}
+
+	binding->HidDetached = uConsoleDetached;
+	binding->HidDeallocate = uConsoleDeallocate;
+	binding->HidReportReceived = uConsoleReportReceived;
+	uconsoleDev = device;
+	LOG_DEBUGF("UCONSOLE: New uConsole assigned %d!\n", device->Number);
+	return OK;
 }
 
 bool uConsolePersent(){
 	return !!uconsoleDev;
 }
 
+Result uConsolePoll() {
+	Result result;
 
+	if (uconsoleDev == NULL)
+		return ErrorDevice;
 
-Result uConsolePoll(u32 keyboardAddress) {
+	if ((result = HidPoll(uconsoleDev)) != OK && result != ErrorRetry) {
+		if (result != ErrorDisconnected)
+			LOG_WARNINGF("UCONSOLE: Could not get report from %s.\n", UsbGetDescription(uconsoleDev));
+		return result;
+	}
 
+	// Every report drained is queued by uConsoleReportReceived.
+	HidDrainReports(uconsoleDev, HidReportRingSize);
 	return OK;
 }
 
-Result uConsoleGetEvent(u8* event){
-	u8 buffer[128] = {0};
-	Result ret;
+u32 uConsoleReadEvents(struct UConsoleEvent *events, u32 count) {
+	struct UConsoleDevice *data;
+	u32 head, tail, read;
 
-	if(uconsoleDev == NULL)
-		return ErrorDevice;
+	if (uconsoleDev == NULL)
+		return 0;
+	data = (struct UConsoleDevice*)HidGetDriverData(uconsoleDev, DeviceDriverUConsole);
+
+	tail = data->EventTail;
+	head = data->EventHead;
+	MemoryBarrier();
+	for (read = 0; read < count && tail != head; read++, tail++)
+		MemoryCopy(&events[read], &data->Events[tail & (UConsoleEventQueueSize - 1)], sizeof(struct UConsoleEvent));
+	MemoryBarrier();
+	data->EventTail = tail;
+	return read;
+}
+
+Result uConsoleGetEvent(struct UConsoleEvent *event) {
+	Result result;
 
-	ret = HidReadDeviceRaw(uconsoleDev, 1, 1, buffer);
-	if(ret == 0){
-        printf("%02x %02x %02x %02x\n", buffer[0], buffer[1], buffer[2], buffer[3]);
-        memcpy(event, buffer, 8);
-    }	
-	return ret;
+	if ((result = uConsolePoll()) != OK)
+		return result;
+	return uConsoleReadEvents(event, 1) == 1 ? OK : ErrorRetry;
 }
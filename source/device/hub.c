@@ -9,6 +9,7 @@
 *	is designed such that this driver's interface would be virtually the same
 *	across all systems, and in fact its implementation varies little either.
 ******************************************************************************/
+#define LOG_MODULE_LEVEL HUB_LOG_LEVEL
 #include <device/hub.h>
 #include <hcd/hcd.h>
 #include <platform/platform.h>
@@ -19,6 +20,39 @@
 #include <usbd/usbd.h>
 
 #define ControlMessageTimeout 10
+/** The minimum time a hub drives reset on a port, in microseconds. */
+#define HubResetMinimum 10000
+/** The interval between port status polls during reset, in microseconds. */
+#define HubResetPoll 1000
+/** The time after which a port reset attempt is abandoned, in microseconds. */
+#define HubResetTimeout 200000
+/** The time to wait after reset before addressing a device, in microseconds. */
+#define HubResetRecovery 10000
+/** The time a connection must be stable before reset, in microseconds. */
+#define HubDebounceTime 100000
+/** The initial delay before retrying a failed port, in microseconds. */
+#define HubBackOffTime 100000
+/** The number of attempts at bringing up a port before giving up. */
+#define HubPortMaxAttempts 3
+/** The number of checks for change between sweeps of every port. */
+#define HubFullScanInterval 64
+/** The most hubs that can be attached at once; one per device. */
+#define HubMaximum 32
+/** The most passes HubEnumeratePending makes before leaving the remaining 
+	ports to HubCheckForChange. Well above the passes of every attempt at a
+	port, which is dominated by the reset polls. */
+#define HubEnumerateMaxPasses (4 * HubPortMaxAttempts * (HubResetTimeout / HubResetPoll))
+
+static struct UsbDevice *hubs[HubMaximum];
+static u32 hubCount = 0;
+static u32 hubScanCount = 0;
+static struct UsbDevice *hubPending[HubMaximum];
+static u32 hubPendingCount = 0;
+static u32 hubEnumerating = 0;
+static u32 hubScanning = 0;
+
+/** Whether a port in the given state is waiting on its deadline. */
+#define HubPortWaiting(state) ((state) == PortDebounce || (state) == PortReset || (state) == PortRecovery || (state) == PortBackOff)
 
 void HubLoad() 
 {
@@ -34,7 +68,7 @@ Result HubReadDescriptor(struct UsbDevice *device) {
 		LOGF("HUB: Failed to read hub descriptor for %s.\n", UsbGetDescription(device));
 		return result;
 	}
-	LOGF("%s %d\n", __func__, __LINE__);
+	LOG_TRACEF("%s %d\n", __func__, __LINE__);
 	if (((struct HubDevice*)device->DriverData)->Descriptor == NULL &&
 		(((struct HubDevice*)device->DriverData)->Descriptor = MemoryAllocate(header.DescriptorLength)) == NULL) {
 		LOGF("HUB: Not enough memory to read hub descriptor for %s.\n", UsbGetDescription(device));
@@ -173,7 +207,7 @@ Result HubPowerOn(struct UsbDevice *device) {
 			LOGF("HUB: Could not power %s.Port%d.\n", UsbGetDescription(device), i + 1);
 	}
 
-	MicroDelay(hubDescriptor->PowerGoodDelay * 2000);
+	data->PowerGoodTime = MicroTime() + hubDescriptor->PowerGoodDelay * 2000;
 
 	return OK;
 }
@@ -182,104 +216,133 @@ Result HubPortReset(struct UsbDevice *device, u8 port) {
 	Result result;
 	struct HubDevice *data;
 	struct HubPortFullStatus *portStatus;
-	u32 retry, timeout;
+	u64 deadline;
 
 	data = (struct HubDevice*)device->DriverData;
 	portStatus = &data->PortStatus[port];
 
 	LOG_DEBUGF("HUB: Hub reset %s.Port%d.\n", UsbGetDescription(device), port + 1);
-	for (retry = 0; retry < 3; retry++) {
-		if ((result = HubChangePortFeature(device, FeatureReset, port, true)) != OK) {
-			LOGF("HUB: Failed to reset %s.Port%d.\n", UsbGetDescription(device), port + 1);
+	if ((result = HubChangePortFeature(device, FeatureReset, port, true)) != OK) {
+		LOGF("HUB: Failed to reset %s.Port%d.\n", UsbGetDescription(device), port + 1);
+		return result;
+	}
+	deadline = MicroTime() + HubResetTimeout;
+	MicroDelay(HubResetMinimum);
+	while (true) {
+		if ((result = HubPortGetStatus(device, port)) != OK) {
+			LOGF("HUB: Hub failed to get status (4) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
 			return result;
 		}
-		timeout = 0;
-		do {
-			MicroDelay(20000);
-			if ((result = HubPortGetStatus(device, port)) != OK) {
-				LOGF("HUB: Hub failed to get status (4) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
-				return result;
-			}			
-			timeout++;
-		} while (!portStatus->Change.ResetChanged && !portStatus->Status.Enabled && timeout < 10);
-
-		if (timeout == 10)
-			continue;
-		
-		LOG_DEBUGF("HUB: %s.Port%d Status %x:%x.\n", UsbGetDescription(device), port + 1, *(u16*)&portStatus->Status, *(u16*)&portStatus->Change);
-
-		if (portStatus->Change.ConnectedChanged || !portStatus->Status.Connected)
-			return ErrorDevice;
-
-		if (portStatus->Status.Enabled) 
+		if (!portStatus->Status.Reset && (portStatus->Change.ResetChanged || portStatus->Status.Enabled))
 			break;
+		if (MicroTime() >= deadline) {
+			LOGF("HUB: Timed out resetting %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			return ErrorTimeout;
+		}
+		MicroDelay(HubResetPoll);
 	}
-
-	if (retry == 3) {
-		LOGF("HUB: Cannot enable %s.Port%d. Please verify the hardware is working.\n", UsbGetDescription(device), port + 1);
-		return ErrorDevice;
-	}
+	LOG_DEBUGF("HUB: %s.Port%d Status %x:%x.\n", UsbGetDescription(device), port + 1, *(u16*)&portStatus->Status, *(u16*)&portStatus->Change);
 
 	if ((result = HubChangePortFeature(device, FeatureResetChange, port, false)) != OK) {
 		LOGF("HUB: Failed to clear reset on %s.Port%d.\n", UsbGetDescription(device), port + 1);
 	}
+	if (!portStatus->Status.Connected || !portStatus->Status.Enabled)
+		return ErrorDevice;
 	return OK;
 }
 
-Result HubPortConnectionChanged(struct UsbDevice *device, u8 port) {
-	Result result;
+/**
+	\brief Moves a port of a hub to a new state.
+
+	Sets the state of the port, noting when it was entered, and schedules the
+	port's next attention delay microseconds from now.
+*/
+void HubPortSetState(struct HubDevice *data, u8 port, enum HubPortState state, u32 delay) {
+	u64 now;
+
+	now = MicroTime();
+	data->Ports[port].State = state;
+	data->Ports[port].Since = now;
+	data->Ports[port].Deadline = now + delay;
+}
+
+/**
+	\brief Removes the device attached to a port of a hub, if any.
+*/
+void HubPortRemoveChild(struct UsbDevice *device, u8 port) {
 	struct HubDevice *data;
-	struct HubPortFullStatus *portStatus;
 
 	data = (struct HubDevice*)device->DriverData;
-	portStatus = &data->PortStatus[port];
-	
-	if ((result = HubPortGetStatus(device, port)) != OK) {
-		LOGF("HUB: Hub failed to get status (2) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
-		return result;
-	}
-	LOG_DEBUGF("HUB: %s.Port%d Status %x:%x.\n", UsbGetDescription(device), port + 1, *(u16*)&portStatus->Status, *(u16*)&portStatus->Change);
-	
-	if ((result = HubChangePortFeature(device, FeatureConnectionChange, port, false)) != OK) {
-		LOGF("HUB: Failed to clear change on %s.Port%d.\n", UsbGetDescription(device), port + 1);
-	}
-	
-	if ((!portStatus->Status.Connected && !portStatus->Status.Enabled) || data->Children[port] != NULL) {
+	if (data->Children[port] != NULL) {
 		LOGF("HUB: Disconnected %s.Port%d - %s.\n", UsbGetDescription(device), port + 1, UsbGetDescription(data->Children[port]));
 		UsbDeallocateDevice(data->Children[port]);
 		data->Children[port] = NULL;
-		if (!portStatus->Status.Connected) return OK;
 	}
-	
-	if ((result = HubPortReset(device, port)) != OK) {
-		LOGF("HUB: Could not reset %s.Port%d for new device.\n", UsbGetDescription(device), port + 1);
-		return result;
+}
+
+/**
+	\brief Handles a failed attempt to bring up a port.
+
+	Disables the port, and backs off for exponentially longer before trying 
+	again, giving up altogether after HubPortMaxAttempts. A port that has been
+	given up on is retried when its device is next plugged in.
+*/
+void HubPortFail(struct UsbDevice *device, u8 port) {
+	struct HubDevice *data;
+
+	data = (struct HubDevice*)device->DriverData;
+	if (HubChangePortFeature(device, FeatureEnable, port, false) != OK) {
+		LOGF("HUB: Failed to disable %s.Port%d.\n", UsbGetDescription(device), port + 1);
 	}
+	if (++data->Ports[port].Attempts >= HubPortMaxAttempts) {
+		LOGF("HUB: Cannot enable %s.Port%d. Please verify the hardware is working.\n", UsbGetDescription(device), port + 1);
+		HubPortSetState(data, port, PortFailed, 0);
+	} else
+		HubPortSetState(data, port, PortBackOff, HubBackOffTime << (data->Ports[port].Attempts - 1));
+}
+
+/**
+	\brief Enumerates the device on a freshly reset port.
+
+	Allocates and attaches a device for the port, which must have completed
+	reset and recovery. The port is in the PortEnumerate state throughout, as
+	this is the only time its device answers at the default address.
+*/
+Result HubPortEnumerate(struct UsbDevice *device, u8 port) {
+	Result result;
+	struct HubDevice *data;
+	struct HubPortFullStatus *portStatus;
+
+	data = (struct HubDevice*)device->DriverData;
+	portStatus = &data->PortStatus[port];
 
 	if ((result = UsbAllocateDevice(&data->Children[port])) != OK) {
 		LOGF("HUB: Could not allocate a new device entry for %s.Port%d.\n", UsbGetDescription(device), port + 1);
 		return result;
 	}
-	
-	if ((result = HubPortGetStatus(device, port)) != OK) {
-		LOGF("HUB: Hub failed to get status (3) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
-		return result;
-	}
-	
-	LOG_DEBUGF("HUB: %s.Port%d Status %x:%x.\n", UsbGetDescription(device), port + 1, *(u16*)&portStatus->Status, *(u16*)&portStatus->Change);
 
 	if (portStatus->Status.HighSpeedAttatched) data->Children[port]->Speed = High;
 	else if (portStatus->Status.LowSpeedAttatched) data->Children[port]->Speed = Low;
 	else data->Children[port]->Speed = Full;
 	data->Children[port]->Parent = device;
 	data->Children[port]->PortNumber = port;
+	if (data->Children[port]->Speed != High) {
+		// Full and low speed devices are reached through the nearest high 
+		// speed hub's TT, which is ours if we have one.
+		if (data->Tts != NULL) {
+			data->Children[port]->Tt = &data->Tts[data->MultiTt ? port : 0];
+			data->Children[port]->TtPort = port + 1;
+		} else {
+			data->Children[port]->Tt = device->Tt;
+			data->Children[port]->TtPort = device->TtPort;
+		}
+	}
+
+	HubPortSetState(data, port, PortEnumerate, 0);
 	if ((result = UsbAttachDevice(data->Children[port])) != OK) {
 		LOGF("HUB: Could not connect to new device in %s.Port%d. Disabling.\n", UsbGetDescription(device), port + 1);
 		UsbDeallocateDevice(data->Children[port]);
 		data->Children[port] = NULL;
-		if (HubChangePortFeature(device, FeatureEnable, port, false) != OK) {
-			LOGF("HUB: Failed to disable %s.Port%d.\n", UsbGetDescription(device), port + 1);
-		}
 		return result;
 	}
 	return OK;
@@ -314,6 +377,21 @@ void HubDeallocate(struct UsbDevice *device) {
 			}
 		}
 			
+		for (u32 i = 0; i < hubPendingCount; i++) {
+			if (hubPending[i] == device) {
+				hubPending[i] = hubPending[--hubPendingCount];
+				break;
+			}
+		}
+		for (u32 i = 0; i < hubCount; i++) {
+			if (hubs[i] == device) {
+				hubs[i] = hubs[--hubCount];
+				break;
+			}
+		}
+
+		if (data->Children != NULL)
+			MemoryDeallocate(data->Children);
 		if (data->Descriptor != NULL)
 			MemoryDeallocate(data->Descriptor);
 		MemoryDeallocate((void*)device->DriverData);
@@ -326,19 +404,126 @@ void HubDeallocate(struct UsbDevice *device) {
 	device->DeviceCheckConnection = NULL;
 }
 
+/**
+	\brief Reads the status change endpoint of a hub.
+
+	Performs one transfer on the hub's interrupt endpoint, which returns a 
+	bitmap of ports with a change, or NAKs if there are none. Marks each 
+	reported port, and the hub, as changed. If the endpoint cannot be read, 
+	every port is marked instead so that no change is missed.
+*/
+void HubReadChanges(struct UsbDevice *device) {
+	struct HubDevice *data;
+	volatile struct UsbEndpointDescriptor *endpoint;
+	u32 changes[(MaxChildrenPerDevice + 1 + 31) / 32];
+	u8 *bitmap;
+	Result result;
+	bool changed;
+
+	data = (struct HubDevice*)device->DriverData;
+	endpoint = &device->Endpoints[data->Interface][0];
+	bitmap = (u8*)changes;
+	MemorySet(changes, 0, sizeof(changes));
+
+	result = UsbInterruptMessage(
+		device, 
+		(struct UsbPipeAddress) { 
+			.Type = Interrupt, 
+			.Speed = device->Speed, 
+			.EndPoint = endpoint->EndpointAddress.Number, 
+			.Device = device->Number, 
+			.Direction = In,
+			.MaxSize = SizeFromNumber(endpoint->Packet.MaxSize),
+		},
+		changes,
+		(data->MaxChildren + 1 + 7) / 8,
+		NULL,
+		ControlMessageTimeout);
+	if (result == ErrorRetry) 
+		return;
+
+	changed = false;
+	for (u32 port = 0; port < data->MaxChildren; port++) {
+		if (result != OK || (bitmap[(port + 1) >> 3] & 1 << ((port + 1) & 0x7))) {
+			data->Ports[port].Changed = true;
+			changed = true;
+		}
+	}
+	if (changed)
+		UsbMarkChanged(device);
+}
+
+/**
+	\brief Finds the hubs with changes before the tree is walked.
+
+	Reads the status change endpoint of every hub, and marks hubs with ports 
+	whose deadline has passed, so that the walk from the root need only 
+	visit changed subtrees. Every so often marks every port of every hub as 
+	a safety net against missed changes.
+*/
+void HubPollChanges() {
+	struct HubDevice *data;
+	bool fullScan;
+	u64 now;
+
+	fullScan = ++hubScanCount >= HubFullScanInterval;
+	if (fullScan) hubScanCount = 0;
+	now = MicroTime();
+
+	for (u32 i = 0; i < hubCount; i++) {
+		data = (struct HubDevice*)hubs[i]->DriverData;
+		if (now < data->PowerGoodTime)
+			continue;
+		if (fullScan) {
+			for (u32 port = 0; port < data->MaxChildren; port++)
+				data->Ports[port].Changed = true;
+			UsbMarkChanged(hubs[i]);
+			continue;
+		}
+
+		HubReadChanges(hubs[i]);
+		for (u32 port = 0; port < data->MaxChildren; port++) {
+			if (HubPortWaiting(data->Ports[port].State) && now >= data->Ports[port].Deadline) {
+				UsbMarkChanged(hubs[i]);
+				break;
+			}
+		}
+	}
+}
+
 void HubCheckForChange(struct UsbDevice *device) {
 	struct HubDevice *data;
+	struct HubPort *hubPort;
+	u64 now;
 	
 	data = (struct HubDevice*)device->DriverData;
 	
+	if (hubScanning == 0)
+		HubPollChanges();
+	if (!device->Changed)
+		return;
+	device->Changed = false;
+	now = MicroTime();
+
+	hubScanning++;
 	for (u32 i = 0; i < data->MaxChildren; i++) {
-		if (HubCheckConnection(device, i) != OK)
-			continue;
+		hubPort = &data->Ports[i];
+		if (hubPort->Changed || (HubPortWaiting(hubPort->State) && now >= hubPort->Deadline)) {
+			hubPort->Changed = false;
+			if (HubCheckConnection(device, i) != OK) {
+				hubPort->Changed = true;
+				UsbMarkChanged(device);
+				continue;
+			}
+		}
 
-		if (data->Children[i] != NULL && 
+		if (data->Ports[i].State == PortEnabled &&
+			data->Children[i] != NULL && 
+			data->Children[i]->Changed &&
 			data->Children[i]->DeviceCheckForChange != NULL)
 				data->Children[i]->DeviceCheckForChange(data->Children[i]);
 	}
+	hubScanning--;
 }
 
 void HubChildDetached(struct UsbDevice *device, struct UsbDevice *child) {
@@ -357,7 +542,8 @@ Result HubChildReset(struct UsbDevice *device, struct UsbDevice *child) {
 	data = (struct HubDevice*)device->DriverData;
 	
 	if (child->Parent == device && child->PortNumber >= 0 && child->PortNumber < data->MaxChildren &&
-		data->Children[child->PortNumber] == child)
+		data->Children[child->PortNumber] == child &&
+		data->Ports[child->PortNumber].State == PortEnumerate)
 		return HubPortReset(device, child->PortNumber);
 	else
 		return ErrorDevice;
@@ -371,9 +557,13 @@ Result HubCheckConnectionDevice(struct UsbDevice *device, struct UsbDevice *chil
 	
 	if (child->Parent == device && child->PortNumber >= 0 && child->PortNumber < data->MaxChildren &&
 		data->Children[child->PortNumber] == child) {
-		if ((result = HubCheckConnection(device, child->PortNumber)) != OK)
+		// Only report on the connection here; the child may be mid transfer,
+		// so any disconnection is left to the port's state machine.
+		data->Ports[child->PortNumber].Changed = true;
+		UsbMarkChanged(device);
+		if ((result = HubPortGetStatus(device, child->PortNumber)) != OK)
 			return result;
-		return data->Children[child->PortNumber] == child ? OK : ErrorDisconnected;
+		return data->PortStatus[child->PortNumber].Status.Connected ? OK : ErrorDisconnected;
 	}
 	else
 		return ErrorArgument;
@@ -383,14 +573,32 @@ Result HubCheckConnection(struct UsbDevice *device, u8 port) {
 	Result result;
 	struct HubPortFullStatus *portStatus;
 	struct HubDevice *data;
+	struct HubPort *hubPort;
 	int prevConnected;
+	u64 now;
 
 	data = (struct HubDevice*)device->DriverData;
-	prevConnected = data->PortStatus[port].Status.Connected;
+	hubPort = &data->Ports[port];
+	now = MicroTime();
+
+	// Ports waiting on a deadline have nothing to do until it passes. The hub
+	// latches any change in the meantime, so it is still seen afterwards.
+	if (now < data->PowerGoodTime || hubPort->State == PortEnumerate ||
+		(HubPortWaiting(hubPort->State) && now < hubPort->Deadline))
+		return OK;
 
+	prevConnected = data->PortStatus[port].Status.Connected;
 	if ((result = HubPortGetStatus(device, port)) != OK) {
 		if (result != ErrorDisconnected)
-			LOGF("HUB: Failed to get hub port status (1) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			LOG_WARNINGF("HUB: Failed to get hub port status (1) for %s.Port%d.\n", UsbGetDescription(device), port + 1);
+		// A waiting port must not be left with its deadline passed, or it 
+		// would be checked again straight away, forever if the hub is gone.
+		if (HubPortWaiting(hubPort->State)) {
+			if (result == ErrorDisconnected)
+				HubPortSetState(data, port, PortFailed, 0);
+			else
+				HubPortFail(device, port);
+		}
 		return result;
 	}
 	portStatus = &data->PortStatus[port];
@@ -400,45 +608,155 @@ Result HubCheckConnection(struct UsbDevice *device, u8 port) {
 		}
 	}
 
+	// Acknowledge every change; portStatus keeps them for the decisions below.
 	if (portStatus->Change.ConnectedChanged) {
-		HubPortConnectionChanged(device, port);
+		if (HubChangePortFeature(device, FeatureConnectionChange, port, false) != OK) {
+			LOG_WARNINGF("HUB: Failed to clear change on %s.Port%d.\n", UsbGetDescription(device), port + 1);
+		}
 	}
 	if (portStatus->Change.EnabledChanged) {
 		if (HubChangePortFeature(device, FeatureEnableChange, port, false) != OK) {
-			LOGF("HUB: Failed to clear enable change %s.Port%d.\n", UsbGetDescription(device), port + 1);
-		}
-	
-		// This may indicate EM interference.
-		if (!portStatus->Status.Enabled && portStatus->Status.Connected && data->Children[port] != NULL) {
-			LOGF("HUB: %s.Port%d has been disabled, but is connected. This can be cause by interference. Reenabling!\n", UsbGetDescription(device), port + 1);
-			HubPortConnectionChanged(device, port);
+			LOG_WARNINGF("HUB: Failed to clear enable change %s.Port%d.\n", UsbGetDescription(device), port + 1);
 		}
 	}
 	if (portStatus->Status.Suspended) {			
 		if (HubChangePortFeature(device, FeatureSuspend, port, false) != OK) {
-			LOGF("HUB: Failed to clear suspended port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			LOG_WARNINGF("HUB: Failed to clear suspended port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
+		}
+	}
+	if (portStatus->Change.ResetChanged && hubPort->State != PortReset) {
+		if (HubChangePortFeature(device, FeatureResetChange, port, false) != OK) {
+			LOG_WARNINGF("HUB: Failed to clear reset port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
 		}
 	}
 	if (portStatus->Change.OverCurrentChanged) {		
 		if (HubChangePortFeature(device, FeatureOverCurrentChange, port, false) != OK) {
-			LOGF("HUB: Failed to clear over current port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			LOG_WARNINGF("HUB: Failed to clear over current port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
 		}
+		HubPortRemoveChild(device, port);
 		HubPowerOn(device);
+		hubPort->Attempts = 0;
+		HubPortSetState(data, port, PortDisconnected, 0);
+		return OK;
 	}
-	if (portStatus->Change.ResetChanged) {
-		if (HubChangePortFeature(device, FeatureResetChange, port, false) != OK) {
-			LOGF("HUB: Failed to clear reset port - %s.Port%d.\n", UsbGetDescription(device), port + 1);
+
+	// Any change of connection starts the port over, debouncing if connected.
+	if (portStatus->Change.ConnectedChanged) {
+		HubPortRemoveChild(device, port);
+		hubPort->Attempts = 0;
+		if (portStatus->Status.Connected)
+			HubPortSetState(data, port, PortDebounce, HubDebounceTime);
+		else
+			HubPortSetState(data, port, PortDisconnected, 0);
+		return OK;
+	}
+
+	switch (hubPort->State) {
+	case PortDisconnected:
+		// Some hubs do not report a connection change for devices that were 
+		// present at power on.
+		if (portStatus->Status.Connected)
+			HubPortSetState(data, port, PortDebounce, HubDebounceTime);
+		break;
+	case PortDebounce:
+	case PortBackOff:
+		if (!portStatus->Status.Connected) {
+			HubPortSetState(data, port, PortDisconnected, 0);
+			break;
+		}
+		LOG_DEBUGF("HUB: Hub reset %s.Port%d.\n", UsbGetDescription(device), port + 1);
+		if (HubChangePortFeature(device, FeatureReset, port, true) != OK) {
+			LOG_WARNINGF("HUB: Failed to reset %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			HubPortFail(device, port);
+			break;
+		}
+		HubPortSetState(data, port, PortReset, HubResetMinimum);
+		break;
+	case PortReset:
+		if (!portStatus->Status.Connected) {
+			HubPortSetState(data, port, PortDisconnected, 0);
+		} else if (!portStatus->Status.Reset && (portStatus->Change.ResetChanged || portStatus->Status.Enabled)) {
+			LOG_DEBUGF("HUB: %s.Port%d Status %x:%x.\n", UsbGetDescription(device), port + 1, *(u16*)&portStatus->Status, *(u16*)&portStatus->Change);
+			if (HubChangePortFeature(device, FeatureResetChange, port, false) != OK) {
+				LOG_WARNINGF("HUB: Failed to clear reset on %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			}
+			if (portStatus->Status.Enabled)
+				HubPortSetState(data, port, PortRecovery, HubResetRecovery);
+			else
+				HubPortFail(device, port);
+		} else if (now - hubPort->Since >= HubResetTimeout) {
+			LOG_WARNINGF("HUB: Timed out resetting %s.Port%d.\n", UsbGetDescription(device), port + 1);
+			HubPortFail(device, port);
+		} else
+			hubPort->Deadline = now + HubResetPoll;
+		break;
+	case PortRecovery:
+		if (!portStatus->Status.Connected) {
+			HubPortSetState(data, port, PortDisconnected, 0);
+		} else if (!portStatus->Status.Enabled) {
+			HubPortFail(device, port);
+		} else if (HubPortEnumerate(device, port) != OK) {
+			HubPortFail(device, port);
+		} else {
+			hubPort->Attempts = 0;
+			HubPortSetState(data, port, PortEnabled, 0);
 		}
+		break;
+	case PortEnabled:
+		// This may indicate EM interference.
+		if (portStatus->Change.EnabledChanged && !portStatus->Status.Enabled && portStatus->Status.Connected) {
+			LOG_WARNINGF("HUB: %s.Port%d has been disabled, but is connected. This can be cause by interference. Reenabling!\n", UsbGetDescription(device), port + 1);
+			HubPortRemoveChild(device, port);
+			HubPortSetState(data, port, PortDebounce, HubDebounceTime);
+		}
+		break;
+	case PortEnumerate:
+	case PortFailed:
+		break;
 	}
 
 	return OK;
 }
 
+/**
+	\brief Selects the multi TT alternate setting of a hub, if offered.
+
+	A high speed hub capable of multi TT operation has an alternate setting 
+	with protocol 2 on its interface. Selecting it gives each port its own 
+	TT, so devices on different ports do not contend for one. Returns true if
+	the hub is now operating with one TT per port.
+*/
+bool HubSelectMultiTt(struct UsbDevice *device, u32 interfaceNumber) {
+	struct UsbDescriptorHeader *header;
+	struct UsbInterfaceDescriptor *interface;
+
+	if (device->Descriptor.Protocol != 2 || device->FullConfiguration == NULL)
+		return false;
+
+	for (header = (struct UsbDescriptorHeader*)device->FullConfiguration;
+		(u32)header - (u32)device->FullConfiguration < device->Configuration.TotalLength && header->DescriptorLength > 0;
+		header = (struct UsbDescriptorHeader*)((u8*)header + header->DescriptorLength)) {
+		if (header->DescriptorType != Interface) continue;
+		interface = (struct UsbInterfaceDescriptor*)header;
+		if (interface->Number == interfaceNumber && interface->AlternateSetting != 0 &&
+			interface->Protocol == 2) {
+			if (UsbSetInterface(device, interfaceNumber, interface->AlternateSetting) != OK) {
+				LOGF("HUB: Failed to select multi TT operation on %s.\n", UsbGetDescription(device));
+				return false;
+			}
+			LOG_DEBUG("HUB: Hub TT: Multi.\n");
+			return true;
+		}
+	}
+	return false;
+}
+
 Result HubAttach(struct UsbDevice *device, u32 interfaceNumber) {
 	Result result;
 	struct HubDevice *data;
 	struct HubDescriptor *hubDescriptor;
 	struct HubFullStatus *status;
+	u32 ttCount, size;
 	
 	if (device->Interfaces[interfaceNumber].EndpointCount != 1) {
 		LOGF("HUB: Cannot enumerate hub with multiple endpoints: %d.\n", device->Interfaces[interfaceNumber].EndpointCount);
@@ -464,19 +782,42 @@ Result HubAttach(struct UsbDevice *device, u32 interfaceNumber) {
 		return ErrorMemory;
 	}
 	data = (struct HubDevice*)device->DriverData;
+	MemorySet(data, 0, sizeof(struct HubDevice));
 	device->DriverData->DataSize = sizeof(struct HubDevice);
 	device->DriverData->DeviceDriver = DeviceDriverHub;
-	for (u32 i = 0; i < MaxChildrenPerDevice; i++)
-		data->Children[i] = NULL;
+	data->Interface = interfaceNumber;
 
 	if ((result = HubReadDescriptor(device)) != OK) return result;
 
 	hubDescriptor = data->Descriptor;
-	if (hubDescriptor->PortCount > MaxChildrenPerDevice) {
-		LOGF("HUB: Hub %s is too big for this driver to handle. Only the first %d ports will be used. Change MaxChildrenPerDevice in usbd/device.h.\n", UsbGetDescription(device), MaxChildrenPerDevice);
-		data->MaxChildren = MaxChildrenPerDevice;
-	} else
-		data->MaxChildren = hubDescriptor->PortCount;
+	ttCount = 0;
+	if (device->Speed == High && device->Parent != NULL) {
+		data->MultiTt = HubSelectMultiTt(device, interfaceNumber);
+		ttCount = data->MultiTt ? hubDescriptor->PortCount : 1;
+	}
+	if (hubDescriptor->PortCount > 0) {
+		// Children, PortStatus, Ports and Tts share one allocation, sized for 
+		// this hub.
+		size = hubDescriptor->PortCount * (sizeof(struct UsbDevice*) + sizeof(struct HubPortFullStatus) + sizeof(struct HubPort)) + ttCount * sizeof(struct UsbTransactionTranslator);
+		if ((data->Children = MemoryAllocate(size)) == NULL) {
+			LOG("HUB: Cannot allocate hub port data. Out of memory.\n");
+			HubDeallocate(device);
+			return ErrorMemory;
+		}
+		// Not every memory manager zeroes allocations; the children and port
+		// states must start empty.
+		MemorySet(data->Children, 0, size);
+		data->PortStatus = (struct HubPortFullStatus*)(data->Children + hubDescriptor->PortCount);
+		data->Ports = (struct HubPort*)(data->PortStatus + hubDescriptor->PortCount);
+		if (ttCount > 0) {
+			data->Tts = (struct UsbTransactionTranslator*)(data->Ports + hubDescriptor->PortCount);
+			for (u32 i = 0; i < ttCount; i++) {
+				data->Tts[i].Hub = device;
+				data->Tts[i].ThinkTime = (hubDescriptor->Attributes.ThinkTime + 1) * 8;
+			}
+		}
+	}
+	data->MaxChildren = hubDescriptor->PortCount;
 
 	switch (hubDescriptor->Attributes.PowerSwitchingMode) {
 	case Global:
@@ -523,6 +864,7 @@ Result HubAttach(struct UsbDevice *device, u32 interfaceNumber) {
 	
 	if ((result = HubGetStatus(device)) != OK) {
 		LOGF("HUB: Failed to get hub status for %s.\n", UsbGetDescription(device));
+		HubDeallocate(device);
 		return result;
 	}
 	status = &data->Status;
@@ -532,29 +874,89 @@ Result HubAttach(struct UsbDevice *device, u32 interfaceNumber) {
 	if (!status->Status.OverCurrent) LOG_DEBUG("USB Hub over current condition: No.\n");
 	else LOG_DEBUG("HUB: Hub over current condition: Yes.\n");
 
+	if (hubCount >= HubMaximum) {
+		LOGF("HUB: Cannot attach %s. Too many hubs.\n", UsbGetDescription(device));
+		HubDeallocate(device);
+		return ErrorMemory;
+	}
+
 	LOG_DEBUG("HUB: Hub powering on.\n");
 	if ((result = HubPowerOn(device)) != OK) {
 		LOG_DEBUG("HUB: Hub failed to power on.\n");
 		HubDeallocate(device);
 		return result;
 	}
-
-	if ((result = HubGetStatus(device)) != OK) {
-		LOGF("HUB: Failed to get hub status for %s.\n", UsbGetDescription(device));
-		HubDeallocate(device);
-		return result;
+	hubs[hubCount++] = device;
+	for (u32 i = 0; i < data->MaxChildren; i++)
+		data->Ports[i].Changed = true;
+	UsbMarkChanged(device);
+
+	// Rather than waiting for power good here, queue the hub. If we are being
+	// enumerated by another hub, its remaining ports (possibly more hubs) are
+	// checked meanwhile, and all of the delays elapse together. Hubs found by
+	// HubCheckForChange are not waited for at all; their ports come up over
+	// the following checks.
+	if (hubEnumerating > 0 || hubScanning == 0) {
+		if (hubPendingCount >= HubMaximum) {
+			LOGF("HUB: Cannot attach %s. Too many hubs pending.\n", UsbGetDescription(device));
+			HubDeallocate(device);
+			return ErrorMemory;
+		}
+		hubPending[hubPendingCount++] = device;
+		if (hubEnumerating == 0)
+			HubEnumeratePending();
 	}
 
-	if (!status->Status.LocalPower) LOG_DEBUG("USB Hub power: Good.\n");
-	else LOG_DEBUG("HUB: Hub power: Lost.\n");
-	if (!status->Status.OverCurrent) LOG_DEBUG("USB Hub over current condition: No.\n");
-	else LOG_DEBUG("HUB: Hub over current condition: Yes.\n");
+	return OK;
+}
 
-	LOG_DEBUGF("HUB: %s status %x:%x.\n", UsbGetDescription(device), *(u16*)&status->Status, *(u16*)&status->Change);
-	
-	for (u8 port = 0; port < data->MaxChildren; port++) {
-		HubCheckConnection(device, port);
-	}
+void HubEnumeratePending() {
+	struct HubDevice *data;
+	u64 next, now;
+	bool settling;
+	u32 passes;
+
+	passes = 0;
+	while (hubPendingCount > 0) {
+		if (passes++ >= HubEnumerateMaxPasses) {
+			LOG_WARNING("HUB: Ports still settling after enumeration. Leaving them to later checks.\n");
+			hubPendingCount = 0;
+			break;
+		}
+		hubEnumerating++;
+		for (u32 i = 0; i < hubPendingCount; i++) {
+			data = (struct HubDevice*)hubPending[i]->DriverData;
+			for (u8 port = 0; port < data->MaxChildren; port++)
+				HubCheckConnection(hubPending[i], port);
+		}
+		hubEnumerating--;
+
+		// Drop hubs whose ports have all settled, and sleep until the next
+		// deadline of the rest.
+		next = (u64)-1;
+		now = MicroTime();
+		for (u32 i = 0; i < hubPendingCount; ) {
+			data = (struct HubDevice*)hubPending[i]->DriverData;
+			settling = false;
+			if (now < data->PowerGoodTime) {
+				settling = true;
+				if (data->PowerGoodTime < next)
+					next = data->PowerGoodTime;
+			} else {
+				for (u32 port = 0; port < data->MaxChildren; port++) {
+					if (HubPortWaiting(data->Ports[port].State)) {
+						settling = true;
+						if (data->Ports[port].Deadline < next)
+							next = data->Ports[port].Deadline;
+					}
+				}
+			}
+			if (settling) i++;
+			else hubPending[i] = hubPending[--hubPendingCount];
+		}
 
-	return OK;
+		now = MicroTime();
+		if (hubPendingCount > 0 && next > now)
+			MicroDelay((u32)(next - now));
+	}
 }
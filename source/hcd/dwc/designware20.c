@@ -10,6 +10,7 @@
 *
 *	THIS SOFTWARE IS NOT AFFILIATED WITH NOR ENDORSED BY SYNOPSYS IP.
 ******************************************************************************/
+#define LOG_MODULE_LEVEL HCD_LOG_LEVEL
 #include <hcd/hcd.h>
 #include <types.h>
 #include <usbd/device.h>
@@ -26,6 +27,7 @@ volatile struct HostGlobalRegs *HostPhysical, *Host = NULL;
 volatile struct PowerReg *PowerPhysical, *Power = NULL;
 bool PhyInitialised = false;
 u8* databuffer = NULL;
+#define DataBufferSize 1024
 u8* requestbuffer = NULL;
 
 void DwcLoad() 
@@ -242,17 +244,17 @@ Result HcdPrepareChannel(struct UsbDevice *device, u8 channel,
 	Host->Channel[channel].Characteristic.EndPointDirection = pipe->Direction;
 	Host->Channel[channel].Characteristic.LowSpeed = pipe->Speed == Low ? true : false;
 	Host->Channel[channel].Characteristic.Type = pipe->Type;
-	Host->Channel[channel].Characteristic.MaximumPacketSize = SizeToNumber(pipe->MaxSize);
+	Host->Channel[channel].Characteristic.MaximumPacketSize = pipe->PacketSize != 0 ? pipe->PacketSize : SizeToNumber(pipe->MaxSize);
 	Host->Channel[channel].Characteristic.Enable = false;
 	Host->Channel[channel].Characteristic.Disable = false;
 	WriteThroughReg(&Host->Channel[channel].Characteristic);
 
 	// Clear split control.
 	ClearReg(&Host->Channel[channel].SplitControl);
-	if ((pipe->Speed != High) && (device->Parent != NULL) && (device->Parent->Speed == High) && (device->Parent->Parent != NULL)) {
+	if ((pipe->Speed != High) && (device->Tt != NULL)) {
 		Host->Channel[channel].SplitControl.SplitEnable = true;
-		Host->Channel[channel].SplitControl.HubAddress = device->Parent->Number;
-		Host->Channel[channel].SplitControl.PortAddress = device->PortNumber;			
+		Host->Channel[channel].SplitControl.HubAddress = device->Tt->Hub->Number;
+		Host->Channel[channel].SplitControl.PortAddress = device->TtPort;
 	}
 	WriteThroughReg(&Host->Channel[channel].SplitControl);
 
@@ -301,12 +303,12 @@ Result HcdChannelInterruptToError(struct UsbDevice *device, struct ChannelInterr
 	result = OK;
 	if (interrupts.AhbError) {
 		device->Error = AhbError;
-		LOG("HCD: AHB error in transfer.\n");
+		LOG_WARNING("HCD: AHB error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.Stall) {
 		device->Error =  Stall;
-		LOG("HCD: Stall error in transfer.\n");
+		LOG_WARNING("HCD: Stall error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.NegativeAcknowledgement) {
@@ -315,36 +317,36 @@ Result HcdChannelInterruptToError(struct UsbDevice *device, struct ChannelInterr
 		return ErrorDevice;
 	}
 	if (!interrupts.Acknowledgement) {
-		LOG("HCD: Transfer was not acknowledged.\n");
+		LOG_WARNING("HCD: Transfer was not acknowledged.\n");
 		result = ErrorTimeout;
 	}
 	if (interrupts.NotYet) {
 		device->Error =  NotYetError;
-		LOG("HCD: Not yet error in transfer.\n");
+		LOG_WARNING("HCD: Not yet error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.BabbleError) {
 		device->Error =  Babble;
-		LOG("HCD: Babble error in transfer.\n");
+		LOG_WARNING("HCD: Babble error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.FrameOverrun) {
 		device->Error =  BufferError;
-		LOG("HCD: Frame overrun in transfer.\n");
+		LOG_WARNING("HCD: Frame overrun in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.DataToggleError) {
 		device->Error =  BitError;
-		LOG("HCD: Data toggle error in transfer.\n");
+		LOG_WARNING("HCD: Data toggle error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (interrupts.TransactionError) {
 		device->Error =  ConnectionError;
-		LOG("HCD: Transaction error in transfer.\n");
+		LOG_WARNING("HCD: Transaction error in transfer.\n");
 		return ErrorDevice;
 	}
 	if (!interrupts.TransferComplete && isComplete) {
-		LOG("HCD: Transfer did not complete.\n");
+		LOG_WARNING("HCD: Transfer did not complete.\n");
 		result = ErrorTimeout;
 	}
 	return result;
@@ -367,7 +369,7 @@ Result HcdChannelSendWaitOne(struct UsbDevice *device,
 		timeout = 0;
 		do {
 			if (timeout++ == RequestTimeout) {
-				LOGF("HCD: Request to %s has timed out.\n", UsbGetDescription(device));
+				LOG_WARNINGF("HCD: Request to %s has timed out.\n", UsbGetDescription(device));
 				device->Error = ConnectionError;
 				return ErrorTimeout;
 			}
@@ -394,7 +396,7 @@ Result HcdChannelSendWaitOne(struct UsbDevice *device,
 					timeout = 0;
 					do {
 						if (timeout++ == RequestTimeout) {
-							LOGF("HCD: Request split completion to %s has timed out.\n", UsbGetDescription(device));
+							LOG_WARNINGF("HCD: Request split completion to %s has timed out.\n", UsbGetDescription(device));
 							device->Error = ConnectionError;
 							return ErrorTimeout;
 						}
@@ -421,7 +423,7 @@ Result HcdChannelSendWaitOne(struct UsbDevice *device,
 					LOG_DEBUGF("HCD: Control message to %#x: %02x%02x%02x%02x %02x%02x%02x%02x.\n", *(u32*)pipe, 
 						((u8*)request)[0], ((u8*)request)[1], ((u8*)request)[2], ((u8*)request)[3],
 						((u8*)request)[4], ((u8*)request)[5], ((u8*)request)[6], ((u8*)request)[7]);
-					LOGF("HCD: Request split completion to %s failed.\n", UsbGetDescription(device));
+					LOG_WARNINGF("HCD: Request split completion to %s failed.\n", UsbGetDescription(device));
 					return result;
 				}
 			} else if (Host->Channel[channel].Interrupt.NegativeAcknowledgement) {
@@ -437,7 +439,7 @@ Result HcdChannelSendWaitOne(struct UsbDevice *device,
 				LOG_DEBUGF("HCD: Control message to %#x: %02x%02x%02x%02x %02x%02x%02x%02x.\n", *(u32*)pipe, 
 					((u8*)request)[0], ((u8*)request)[1], ((u8*)request)[2], ((u8*)request)[3],
 					((u8*)request)[4], ((u8*)request)[5], ((u8*)request)[6], ((u8*)request)[7]);
-				LOGF("HCD: Request to %s failed.\n", UsbGetDescription(device));
+				LOG_WARNINGF("HCD: Request to %s failed.\n", UsbGetDescription(device));
 				return ErrorRetry;
 			}
 		}
@@ -446,12 +448,12 @@ Result HcdChannelSendWaitOne(struct UsbDevice *device,
 	}
 
 	if (globalTries == 3 || actualTries == 10) {
-		LOGF("HCD: Request to %s has failed 3 times.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Request to %s has failed 3 times.\n", UsbGetDescription(device));
 		if ((result = HcdChannelInterruptToError(device, Host->Channel[channel].Interrupt, !Host->Channel[channel].SplitControl.SplitEnable)) != OK) {
 			LOG_DEBUGF("HCD: Control message to %#x: %02x%02x%02x%02x %02x%02x%02x%02x.\n", *(u32*)pipe, 
 				((u8*)request)[0], ((u8*)request)[1], ((u8*)request)[2], ((u8*)request)[3],
 				((u8*)request)[4], ((u8*)request)[5], ((u8*)request)[6], ((u8*)request)[7]);
-			LOGF("HCD: Request to %s failed.\n", UsbGetDescription(device));
+			LOG_WARNINGF("HCD: Request to %s failed.\n", UsbGetDescription(device));
 			return result;
 		}
 		device->Error = ConnectionError;
@@ -470,13 +472,13 @@ Result HcdChannelSendWait(struct UsbDevice *device,
 	tries = 0;
 retry:
 	if (tries++ == 3) {
-		LOGF("HCD: Failed to send to %s after 3 attempts.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Failed to send to %s after 3 attempts.\n", UsbGetDescription(device));
 		return ErrorTimeout;
 	} 
 
 	if ((result = HcdPrepareChannel(device, channel, bufferLength, packetId, pipe)) != OK) {		
 		device->Error = ConnectionError;
-		LOGF("HCD: Could not prepare data channel to %s.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Could not prepare data channel to %s.\n", UsbGetDescription(device));
 		return result;
 	}
 
@@ -495,12 +497,12 @@ retry:
 
 	if (packets == Host->Channel[channel].TransferSize.PacketCount) {
 		device->Error = ConnectionError;
-		LOGF("HCD: Transfer to %s got stuck.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Transfer to %s got stuck.\n", UsbGetDescription(device));
 		return ErrorDevice;
 	}
 
 	if (tries > 1) {
-		LOGF("HCD: Transfer to %s succeeded on attempt %d/3.\n", UsbGetDescription(device), tries);
+		LOG_INFOF("HCD: Transfer to %s succeeded on attempt %d/3.\n", UsbGetDescription(device), tries);
 	}
 
 	return OK;
@@ -561,22 +563,23 @@ Result HcdChannelSendOneNoRetry(struct UsbDevice *device,
 			}
 
 			if (Host->Channel[channel].Interrupt.NegativeAcknowledgement) {
-				return result;
+				device->Error = NoAcknowledge;
+				return ErrorRetry;
 			} else if (Host->Channel[channel].Interrupt.TransactionError) {
-				return result;
+				device->Error = ConnectionError;
+				return ErrorRetry;
 			}
 	
 			if ((result = HcdChannelInterruptToError(device, Host->Channel[channel].Interrupt, false)) != OK) {
-				LOG_DEBUGF("HCD: Control message to %#x: %02x%02x%02x%02x %02x%02x%02x%02x.\n", *(u32*)pipe, 
-					((u8*)request)[0], ((u8*)request)[1], ((u8*)request)[2], ((u8*)request)[3],
-					((u8*)request)[4], ((u8*)request)[5], ((u8*)request)[6], ((u8*)request)[7]);
-				LOGF("HCD: Request split completion to %s failed.\n", UsbGetDescription(device));
+				LOG_WARNINGF("HCD: Request split completion to %s failed.\n", UsbGetDescription(device));
 				return result;
 			}
 		} else if (Host->Channel[channel].Interrupt.NegativeAcknowledgement) {
-			return result;
+			device->Error = NoAcknowledge;
+			return ErrorRetry;
 		} else if (Host->Channel[channel].Interrupt.TransactionError) {
-			result;
+			device->Error = ConnectionError;
+			return ErrorRetry;
 		}				
 	} else {				
 		if ((result = HcdChannelInterruptToError(device, Host->Channel[channel].Interrupt, !Host->Channel[channel].SplitControl.SplitEnable)) != OK) {
@@ -595,7 +598,7 @@ Result HcdChannelSendNoRetry(struct UsbDevice *device,
 	
 	if ((result = HcdPrepareChannel(device, channel, bufferLength, packetId, pipe)) != OK) {		
 		device->Error = ConnectionError;
-		LOGF("HCD: Could not prepare data channel to %s.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Could not prepare data channel to %s.\n", UsbGetDescription(device));
 		return result;
 	}
 
@@ -637,11 +640,12 @@ Result HcdSumbitControlMessage(struct UsbDevice *device,
 	tempPipe.Device = pipe.Device;
 	tempPipe.EndPoint = pipe.EndPoint;
 	tempPipe.MaxSize = pipe.MaxSize;
+	tempPipe.PacketSize = pipe.PacketSize;
 	tempPipe.Type = Control;
 	tempPipe.Direction = Out;
 	memcpy(requestbuffer, request, sizeof(struct UsbDeviceRequest));	
 	if ((result = HcdChannelSendWait(device, &tempPipe, 0, requestbuffer, 8, request, Setup)) != OK) {		
-		LOGF("HCD: Could not send SETUP to %s.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Could not send SETUP to %s.\n", UsbGetDescription(device));
 		return OK;
 	}
 
@@ -654,11 +658,12 @@ Result HcdSumbitControlMessage(struct UsbDevice *device,
 		tempPipe.Device = pipe.Device;
 		tempPipe.EndPoint = pipe.EndPoint;
 		tempPipe.MaxSize = pipe.MaxSize;
+		tempPipe.PacketSize = pipe.PacketSize;
 		tempPipe.Type = Control;
 		tempPipe.Direction = pipe.Direction;
 		
 		if ((result = HcdChannelSendWait(device, &tempPipe, 0, databuffer, bufferLength, request, Data1)) != OK) {		
-			LOGF("HCD: Could not send DATA to %s.\n", UsbGetDescription(device));
+			LOG_WARNINGF("HCD: Could not send DATA to %s.\n", UsbGetDescription(device));
 			return OK;
 		}
 						
@@ -687,11 +692,12 @@ Result HcdSumbitControlMessage(struct UsbDevice *device,
 	tempPipe.Device = pipe.Device;
 	tempPipe.EndPoint = pipe.EndPoint;
 	tempPipe.MaxSize = pipe.MaxSize;
+	tempPipe.PacketSize = pipe.PacketSize;
 	tempPipe.Type = Control;
 	tempPipe.Direction = ((bufferLength == 0) || pipe.Direction == Out) ? In : Out;
 	
 	if ((result = HcdChannelSendWait(device, &tempPipe, 0, databuffer, 0, request, Data1)) != OK) {		
-		LOGF("HCD: Could not send STATUS to %s.\n", UsbGetDescription(device));
+		LOG_WARNINGF("HCD: Could not send STATUS to %s.\n", UsbGetDescription(device));
 		return OK;
 	}
 
@@ -709,6 +715,16 @@ Result HcdSumbitInterruptTransfer(struct UsbDevice *device,
 	struct UsbDeviceRequest *request) {
 	Result result;
 	struct UsbPipeAddress tempPipe;
+	u32 toggle;
+
+	if (pipe.Device == RootHubDeviceNumber) {
+		return HcdProcessRootHubMessage(device, pipe, buffer, bufferLength, request);
+	}
+
+	if (bufferLength > DataBufferSize) {
+		LOG_WARNINGF("HCD: Interrupt transfer of %d bytes to %s is too long.\n", bufferLength, UsbGetDescription(device));
+		return ErrorArgument;
+	}
 
 	device->Error = Processing;
 	device->LastTransfer = 0;
@@ -721,20 +737,27 @@ Result HcdSumbitInterruptTransfer(struct UsbDevice *device,
 	tempPipe.Device = pipe.Device;
 	tempPipe.EndPoint = pipe.EndPoint;
 	tempPipe.MaxSize = pipe.MaxSize;
-	tempPipe.Type = Bulk;
+	tempPipe.PacketSize = pipe.PacketSize;
+	tempPipe.Type = Interrupt;
 	tempPipe.Direction = pipe.Direction;
+	toggle = 1 << (pipe.EndPoint + (pipe.Direction == Out ? 16 : 0));
 	
-	if ((result = HcdChannelSendNoRetry(device, &tempPipe, 1, databuffer, bufferLength, request, Data0)) != OK) {		
+	if ((result = HcdChannelSendNoRetry(device, &tempPipe, 1, databuffer, bufferLength, request, (device->DataToggle & toggle) ? Data1 : Data0)) != OK) {		
 		//LOGF("HCD: Could not send DATA to %s.\n", UsbGetDescription(device));
 		return result;
 	}
 					
-	ReadBackReg(&Host->Channel[0].TransferSize);
+	// The channel leaves PacketId at the toggle expected for the next packet.
+	ReadBackReg(&Host->Channel[1].TransferSize);
+	if (Host->Channel[1].TransferSize.PacketId == Data1)
+		device->DataToggle |= toggle;
+	else
+		device->DataToggle &= ~toggle;
 	if (pipe.Direction == In) {
-		if (Host->Channel[0].TransferSize.TransferSize <= bufferLength)
-			device->LastTransfer = bufferLength - Host->Channel[0].TransferSize.TransferSize;
+		if (Host->Channel[1].TransferSize.TransferSize <= bufferLength)
+			device->LastTransfer = bufferLength - Host->Channel[1].TransferSize.TransferSize;
 		else{
-			LOG_DEBUGF("HCD: Weird transfer.. %d/%d bytes received.\n", Host->Channel[0].TransferSize.TransferSize, bufferLength);
+			LOG_DEBUGF("HCD: Weird transfer.. %d/%d bytes received.\n", Host->Channel[1].TransferSize.TransferSize, bufferLength);
 			LOG_DEBUGF("HCD: Message %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x ...\n", 
 				((u8*)databuffer)[0x0],((u8*)databuffer)[0x1],((u8*)databuffer)[0x2],((u8*)databuffer)[0x3],
 				((u8*)databuffer)[0x4],((u8*)databuffer)[0x5],((u8*)databuffer)[0x6],((u8*)databuffer)[0x7],
@@ -753,6 +776,11 @@ Result HcdSumbitInterruptTransfer(struct UsbDevice *device,
 	return OK;
 }
 
+u32 HcdGetFrameNumber() {
+	ReadBackReg(&Host->FrameNumber);
+	return Host->FrameNumber.FrameNumber;
+}
+
 Result HcdInitialise() {	
 	volatile Result result;
 
@@ -856,7 +884,7 @@ Result HcdStart() {
 		return ErrorDevice;
 	}
 
-	if ((databuffer = MemoryAllocateDMA(1024)) == NULL)
+	if ((databuffer = MemoryAllocateDMA(DataBufferSize)) == NULL)
 		return ErrorMemory;
 
 	if ((requestbuffer = MemoryAllocateDMA(64)) == NULL)
@@ -1006,7 +1034,7 @@ Result HcdStart() {
 				ReadBackReg(&Host->Channel[channel].Characteristic);
 
 				if (timeout++ > 0x100000) {
-					LOGF("HCD: Unable to clear halt on channel %u.\n", channel);
+					LOG_WARNINGF("HCD: Unable to clear halt on channel %u.\n", channel);
 				}
 			} while (Host->Channel[channel].Characteristic.Enable);
 		}
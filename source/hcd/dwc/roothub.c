@@ -12,6 +12,7 @@
 *
 *	THIS SOFTWARE IS NOT AFFILIATED WITH NOR ENDORSED BY SYNOPSYS IP.
 ******************************************************************************/
+#define LOG_MODULE_LEVEL HCD_LOG_LEVEL
 #include <device/hub.h>
 #include <hcd/hcd.h>
 #include <types.h>
@@ -117,6 +118,8 @@ struct HubDescriptor HubDescriptor = {
 };
 
 u32 RootHubDeviceNumber = 0;
+/** The connection state of the port when its status was last read. */
+bool RootHubPortConnected = false;
 
 Result HcdProcessRootHubMessage(struct UsbDevice *device, 
 		struct UsbPipeAddress pipe, void* buffer, u32 bufferLength,
@@ -128,9 +131,19 @@ Result HcdProcessRootHubMessage(struct UsbDevice *device,
 	device->Error = Processing;
 
 	if (pipe.Type == Interrupt) {
-		LOG("HCD.Hub: RootHub does not support IRQ pipes.\n");
-		device->Error = Stall;
-		return OK;
+		// Emulate the status change endpoint. The port does not latch 
+		// disconnection, so compare against the last status read too.
+		ReadBackReg(&Host->Port);
+		if (bufferLength > 0 && (Host->Port.ConnectDetected || Host->Port.EnableChanged || 
+			Host->Port.OverCurrentChanged || Host->Port.Connect != RootHubPortConnected)) {
+			*(u8*)buffer = 1 << 1;
+			device->LastTransfer = 1;
+			device->Error = NoError;
+			return OK;
+		}
+		device->LastTransfer = 0;
+		device->Error = NoAcknowledge;
+		return ErrorRetry;
 	}
 
 	replyLength = 0;
@@ -155,7 +168,7 @@ Result HcdProcessRootHubMessage(struct UsbDevice *device,
 			ReadBackReg(&Host->Port);
 			
 			*(u32*)buffer = 0;
-			((struct HubPortFullStatus*)buffer)->Status.Connected = Host->Port.Connect;
+			((struct HubPortFullStatus*)buffer)->Status.Connected = RootHubPortConnected = Host->Port.Connect;
 			((struct HubPortFullStatus*)buffer)->Status.Enabled = Host->Port.Enable;
 			((struct HubPortFullStatus*)buffer)->Status.Suspended = Host->Port.Suspend;
 			((struct HubPortFullStatus*)buffer)->Status.OverCurrent = Host->Port.OverCurrent;
@@ -29,6 +29,18 @@ void MicroDelay(u32 delay) {
 	usleep(delay);
 }
 
+u64 MicroTime() {
+	volatile u32* timer;
+	u32 high, low;
+
+	timer = (u32*)(_v_mmio_base+0x0003004);
+	do {
+		high = timer[1];
+		low = timer[0];
+	} while (high != timer[1]);
+	return ((u64)high << 32) | low;
+}
+
 Result PowerOnUsb() {
 	volatile u32* mailbox;
 	u32 result;
@@ -457,6 +457,28 @@ void LogPrintF(char* format, u32 formatLength, ...) {
 	
 	LogPrint(messageBuffer, messageIndex);
 }
+
+bool LogRateLimit(struct LogRate *rate) {
+	u64 now;
+
+	now = MicroTime();
+	if (rate->Count == 0 || now - rate->Window >= LOG_RATE_INTERVAL) {
+		if (rate->Suppressed > 0)
+			LOGF("CSUD: Suppressed %u repeats of the next message.\n", rate->Suppressed);
+		rate->Window = now;
+		rate->Count = 1;
+		rate->Suppressed = 0;
+		return true;
+	}
+
+	if (rate->Count < LOG_RATE_BURST) {
+		rate->Count++;
+		return true;
+	}
+
+	rate->Suppressed++;
+	return false;
+}
 #endif
 
 #define DMA_BLOCK		64
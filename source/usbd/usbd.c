@@ -9,6 +9,7 @@
 *	is designed such that this driver's interface would be virtually the same
 *	across all systems, and in fact its implementation varies little either.
 ******************************************************************************/
+#define LOG_MODULE_LEVEL USBD_LOG_LEVEL
 #include <hcd/hcd.h>
 #include <platform/platform.h>
 #include <usbd/descriptors.h>
@@ -334,9 +335,98 @@ Result UsbSetConfiguration(struct UsbDevice *device, u8 configuration) {
 
 	device->ConfigurationIndex = configuration;
 	device->Status = Configured;
+	device->DataToggle = 0;
 	return OK;	
 }
 
+Result UsbSetInterface(struct UsbDevice *device, u8 interface, u8 alternate) {
+	Result result;
+	
+	if (device->Status != Configured) {
+		LOGF("USBD: Illegal attempt to set interface of device %s in state %#x.\n", UsbGetDescription(device), device->Status);
+		return ErrorDevice;
+	}
+
+	if ((result = UsbControlMessage(
+		device, 
+		(struct UsbPipeAddress) { 
+			.Type = Control, 
+			.Speed = device->Speed, 
+			.EndPoint = 0, 
+			.Device = device->Number, 
+			.Direction = Out,
+			.MaxSize = SizeFromNumber(device->Descriptor.MaxPacketSize0),
+		},
+		NULL,
+		0,
+		&(struct UsbDeviceRequest) {
+			.Request = SetInterface,
+			.Type = 1,
+			.Value = alternate,
+			.Index = interface,
+		},
+		ControlMessageTimeout)) != OK)
+		return result;
+
+	device->DataToggle = 0;
+	return OK;	
+}
+
+void UsbMarkChanged(struct UsbDevice *device) {
+	for (; device != NULL; device = device->Parent)
+		device->Changed = true;
+}
+
+u32 UsbGetFrameNumber() {
+	return HcdGetFrameNumber();
+}
+
+/**
+	\brief Estimates the time of a periodic transaction through a TT.
+
+	Returns the worst case full speed byte times of one periodic transaction 
+	of size bytes to a device of the given speed, including bit stuffing, 
+	protocol overhead (USB2.0 5.11.3) and the TT's think time. 
+*/
+u32 UsbTransactionTranslatorTime(struct UsbTransactionTranslator *tt, UsbSpeed speed, u32 size) {
+	size = size * 7 / 6 + 1;
+	if (speed == Low)
+		return 97 + size * 8 + (tt->ThinkTime + 7) / 8;
+	return 14 + size + (tt->ThinkTime + 7) / 8;
+}
+
+/**
+	\brief Reserves the periodic bandwidth of a device in its TT.
+
+	Adds the worst case time of one transaction per frame for every interrupt 
+	and isochronous endpoint of the device to its TT's load. Fails with 
+	ErrorIncompatible if the TT's frame would overflow.
+*/
+Result UsbTransactionTranslatorReserve(struct UsbDevice *device) {
+	struct UsbTransactionTranslator *tt;
+	volatile struct UsbEndpointDescriptor *endpoint;
+	u32 load;
+
+	tt = device->Tt;
+	load = 0;
+	for (u32 i = 0; i < device->Configuration.InterfaceCount && i < MaxInterfacesPerDevice; i++) {
+		for (u32 j = 0; j < device->Interfaces[i].EndpointCount && j < MaxEndpointsPerDevice; j++) {
+			endpoint = &device->Endpoints[i][j];
+			if (endpoint->Attributes.Type == Interrupt || endpoint->Attributes.Type == Isochronous)
+				load += UsbTransactionTranslatorTime(tt, device->Speed, endpoint->Packet.MaxSize);
+		}
+	}
+
+	if (tt->PeriodicLoad + load > TransactionTranslatorPeriodicLimit) {
+		LOGF("USBD: Not enough periodic bandwidth for %s in the TT of %s (%d of %d in use, %d needed).\n", UsbGetDescription(device), UsbGetDescription(tt->Hub), tt->PeriodicLoad, TransactionTranslatorPeriodicLimit, load);
+		return ErrorIncompatible;
+	}
+	tt->PeriodicLoad += load;
+	device->TtLoad = load;
+	LOG_DEBUGF("USBD: %s reserved %d of its TT's frame, %d in use.\n", UsbGetDescription(device), load, tt->PeriodicLoad);
+	return OK;
+}
+
 Result UsbConfigure(struct UsbDevice *device, u8 configuration) {
 	Result result;
 	void* fullDescriptor;
@@ -406,7 +496,16 @@ Result UsbConfigure(struct UsbDevice *device, u8 configuration) {
 	}
 headerLoopBreak:
 
+	if (device->Tt != NULL && device->TtLoad == 0 && 
+		(result = UsbTransactionTranslatorReserve(device)) != OK) {
+		goto deallocate;
+	}
+
 	if ((result = UsbSetConfiguration(device, configuration)) != OK) {		
+		if (device->Tt != NULL) {
+			device->Tt->PeriodicLoad -= device->TtLoad;
+			device->TtLoad = 0;
+		}
 		goto deallocate;
 	}
 	LOG_DEBUGF("USBD: %s configuration %d. Class %d, subclass %d.\n", UsbGetDescription(device), configuration, device->Interfaces[0].Class, device->Interfaces[0].SubClass);
@@ -651,6 +750,9 @@ void UsbDeallocateDevice(struct UsbDevice *device) {
 	if (device->Parent != NULL && device->Parent->DeviceChildDetached != NULL)
 		device->Parent->DeviceChildDetached(device->Parent, device);
 
+	if (device->Tt != NULL)
+		device->Tt->PeriodicLoad -= device->TtLoad;
+
 	if (device->Status == Addressed || device->Status == Configured)
 		if (device->Number > 0 && device->Number <= MaximumDevices && Devices[device->Number - 1] == device)
 			Devices[device->Number - 1] = NULL;